@@ -0,0 +1,322 @@
+/*
+ * Project crash
+ * Description: Inject a crash or a short write at every I/O step of a workload, check that a restarted
+ *              queue holds every committed item exactly once with its disk usage in step with the
+ *              storage, and time the first peek after recovery
+ * Author:
+ * Date:
+ */
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+SerialLogHandler logHandler(115200, LOG_LEVEL_TRACE);
+
+static const uint32_t WORKLOAD_ITEMS = 60;
+static const size_t ITEM_SIZE_MAX = 40;
+static const size_t BACKLOGS[] = { 100, 1000, 5000 };
+
+// Directory of the queue timed on the file system, overridden by host builds
+#ifndef RECOVERY_PATH
+#define RECOVERY_PATH "/recovery"
+#endif
+
+struct Layout {
+  const char* name;
+  size_t segmentSize;
+  float compactionRatio;
+  size_t recordSize;
+  bool coalescing;
+};
+
+static const Layout LAYOUTS[] = {
+  { "file per item", 0, 0.0f, 0, false },
+  { "1k segments", 1024, 0.0f, 0, false },
+  { "file per item coalescing", 0, 0.0f, 0, true },
+  { "256 byte segments coalescing and compacted", 256, 0.25f, 0, true },
+  { "file per item with compact records", 0, 0.0f, 12, false },
+  { "1k segments with compact records", 1024, 0.0f, 12, false },
+};
+
+// What the workload left behind when it stopped
+struct Run {
+  Vector<uint32_t> committed;     // Items that must survive, in queue order
+  Vector<uint32_t> stale;         // Superseded items whose tombstone could not be written, a restart may drop them
+  int pushing;                    // Item being pushed when the storage crashed, -1 if none
+  int removing;                   // Number of front items being popped or drained when the storage crashed
+};
+
+// With coalescing every other item is keyed, cycling through three keys
+static bool keyedItem(const Layout& layout, uint32_t id, uint32_t& key) {
+  key = (id / 2) % 3;
+  return layout.coalescing && (1 == (id % 2));
+}
+
+// Find the queued item a keyed item supersedes, -1 if none
+static int superseded(const Layout& layout, const Run& run, const Vector<uint32_t>& items, uint32_t id) {
+  uint32_t key = 0;
+  if (!keyedItem(layout, id, key)) {
+    return -1;
+  }
+  for (int i = 0; i < items.size(); i++) {
+    uint32_t other = 0;
+    if (keyedItem(layout, items[i], other) && (other == key) && !run.stale.contains(items[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int discard(const uint8_t* data, size_t size, void* context) {
+  return SYSTEM_ERROR_NONE;
+}
+
+// Items carry their number followed by a fill whose length and value derive from it
+static size_t makeItem(uint32_t id, uint8_t* item) {
+  size_t size = sizeof(id) + (id % 5) * 8;
+  memcpy(item, &id, sizeof(id));
+  memset(item + sizeof(id), (int)id, size - sizeof(id));
+  return size;
+}
+
+static bool checkItem(const uint8_t* item, size_t size, uint32_t& id) {
+  uint8_t expected[ITEM_SIZE_MAX];
+  if (sizeof(id) > size) {
+    return false;
+  }
+  memcpy(&id, item, sizeof(id));
+  return (size == makeItem(id, expected)) && !memcmp(item, expected, size);
+}
+
+static int startQueue(DiskQueue& queue, const Layout& layout, DiskQueueStorage* storage, const char* path) {
+  queue.setStorage(storage);
+  queue.setSegmentSize(layout.segmentSize);
+  queue.setCompaction(layout.compactionRatio, 64);
+  queue.setRecordSize(layout.recordSize);
+  queue.setCoalescing(layout.coalescing);
+  return queue.start(path);
+}
+
+// Items no longer counted by the queue are taken off the front of the model
+static void removeFront(DiskQueue& queue, size_t size, Run& run) {
+  for (size_t i = queue.size(); (i < size) && !run.committed.isEmpty(); i++) {
+    run.committed.removeAt(0);
+  }
+}
+
+// Push items, pop every third one and drain two every seventh until the workload completes or
+// the storage crashes
+static void runWorkload(const Layout& layout, DiskQueueFaultStorage& fault, Run& run) {
+  run.committed.clear();
+  run.stale.clear();
+  run.pushing = -1;
+  run.removing = 0;
+
+  DiskQueue queue(64 * 1024);
+  if (SYSTEM_ERROR_NONE != startQueue(queue, layout, &fault, "/crash")) {
+    return;
+  }
+
+  uint8_t item[ITEM_SIZE_MAX];
+  for (uint32_t id = 0; id < WORKLOAD_ITEMS; id++) {
+    uint32_t key = 0;
+    size_t length = makeItem(id, item);
+    size_t size = queue.size();
+    int old = superseded(layout, run, run.committed, id);
+    bool pushed = keyedItem(layout, id, key) ? queue.pushBackKeyed(item, length, key) : queue.pushBack(item, length);
+    if (fault.crashed()) {
+      run.pushing = (int)id;
+      return;
+    }
+    if (pushed) {
+      // A superseded item whose tombstone could not be written stays queued until a restart
+      if ((0 <= old) && (queue.size() > size)) {
+        run.stale.append(run.committed[old]);
+      } else if (0 <= old) {
+        run.committed.removeAt(old);
+      }
+      run.committed.append(id);
+    }
+
+    // An item whose removal could not be recorded stays at the front
+    if ((2 == (id % 3)) && !run.committed.isEmpty()) {
+      size = queue.size();
+      queue.popFront();
+      if (fault.crashed()) {
+        run.removing = 1;
+        return;
+      }
+      removeFront(queue, size, run);
+    }
+
+    if ((6 == (id % 7)) && !run.committed.isEmpty()) {
+      size = queue.size();
+      queue.drainItems(discard, nullptr, 2);
+      if (fault.crashed()) {
+        run.removing = 2;
+        return;
+      }
+      removeFront(queue, size, run);
+    }
+  }
+}
+
+// Check the items read against what the workload committed, allowing for the operation in flight
+// when the storage crashed to have completed or not and for stale items to have been dropped
+static bool matches(const Layout& layout, const Run& run, const Vector<uint32_t>& read) {
+  for (int removed = 0; removed <= run.removing; removed++) {
+    for (int pushed = 0; pushed <= ((0 <= run.pushing) ? 1 : 0); pushed++) {
+      Vector<uint32_t> expected = run.committed;
+      for (int i = 0; (i < removed) && !expected.isEmpty(); i++) {
+        expected.removeAt(0);
+      }
+      if (pushed) {
+        int old = superseded(layout, run, expected, (uint32_t)run.pushing);
+        if (0 <= old) {
+          expected.removeAt(old);
+        }
+        expected.append((uint32_t)run.pushing);
+      }
+
+      int next = 0;
+      for (int i = 0; i < expected.size(); i++) {
+        if ((next < read.size()) && (read[next] == expected[i])) {
+          next++;
+        } else if (!run.stale.contains(expected[i])) {
+          break;
+        }
+      }
+      if (next == read.size()) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Restart on the storage left behind and read everything back, then check that nothing remains on it
+static bool verify(const Layout& layout, DiskQueueRamStorage& ram, const Run& run) {
+  Vector<uint32_t> read;
+  {
+    DiskQueue queue(64 * 1024);
+    if (SYSTEM_ERROR_NONE != startQueue(queue, layout, &ram, "/crash")) {
+      return false;
+    }
+    if (queue.getCurrentDiskUsage() != ram.getUsage()) {
+      Log.error("disk usage %u, %u bytes on storage", queue.getCurrentDiskUsage(), ram.getUsage());
+      return false;
+    }
+
+    uint8_t item[ITEM_SIZE_MAX + 1];
+    while (!queue.isEmpty()) {
+      size_t size = sizeof(item);
+      uint32_t id = 0;
+      if (!queue.peekFront(item, size)) {
+        break;
+      }
+      if (!checkItem(item, size, id)) {
+        Log.error("corrupt item");
+        return false;
+      }
+      read.append(id);
+      queue.popFront();
+    }
+  }
+
+  if (!matches(layout, run, read)) {
+    Log.error("read %d items, %d committed", read.size(), run.committed.size());
+    return false;
+  }
+
+  if (ram.getUsage()) {
+    Log.error("%u bytes left on storage", ram.getUsage());
+    return false;
+  }
+  return true;
+}
+
+// Fault every step of the workload in turn, each on a fresh storage
+static void sweep(const Layout& layout, DiskQueueFault kind) {
+  size_t steps = 0;
+  {
+    DiskQueueRamStorage ram;
+    DiskQueueFaultStorage fault(ram);
+    Run run;
+    runWorkload(layout, fault, run);
+    steps = fault.getSteps();
+  }
+
+  size_t failures = 0;
+  for (size_t step = 1; step <= steps; step++) {
+    DiskQueueRamStorage ram;
+    DiskQueueFaultStorage fault(ram);
+    fault.setFault(step, kind);
+    Run run;
+    runWorkload(layout, fault, run);
+    if (!verify(layout, ram, run)) {
+      Log.error("%s: fault at step %u not recovered", layout.name, step);
+      failures++;
+    }
+  }
+
+  Log.info("%s, %s: %u steps, %u failures", layout.name,
+    (DiskQueueFault::Crash == kind) ? "crash" : "short write", steps, failures);
+}
+
+// Fill a backlog on the device file system, crash while pushing one more item and time the
+// restart up to the first peek
+static void recovery(const Layout& layout, size_t backlog) {
+  DiskQueueFaultStorage fault(DiskQueuePosixStorage::instance());
+  {
+    DiskQueue queue(4 * 1024 * 1024);
+    if (SYSTEM_ERROR_NONE != startQueue(queue, layout, &fault, RECOVERY_PATH)) {
+      Log.error("%s start failed", layout.name);
+      return;
+    }
+
+    uint8_t item[ITEM_SIZE_MAX];
+    for (size_t i = 0; i < backlog; i++) {
+      queue.pushBack(item, makeItem((uint32_t)i, item));
+    }
+
+    // The first write of the next push is torn
+    fault.setFault(fault.getSteps() + 2);
+    queue.pushBack(item, makeItem((uint32_t)backlog, item));
+  }
+
+  DiskQueue queue(4 * 1024 * 1024);
+  uint8_t item[ITEM_SIZE_MAX];
+  size_t size = sizeof(item);
+  auto start = micros();
+  startQueue(queue, layout, &DiskQueuePosixStorage::instance(), RECOVERY_PATH);
+  bool peeked = queue.peekFront(item, size);
+  auto elapsed = micros() - start;
+
+  Log.info("%s, %u items: first peek %s after %lu us", layout.name, backlog,
+    peeked ? "succeeded" : "failed", (unsigned long)elapsed);
+
+  queue.unlinkFiles();
+  queue.stop();
+}
+
+// setup() runs once, when the device is first turned on.
+void setup() {
+  delay(3000);
+  for (auto& layout : LAYOUTS) {
+    sweep(layout, DiskQueueFault::Crash);
+    sweep(layout, DiskQueueFault::ShortWrite);
+  }
+  for (auto backlog : BACKLOGS) {
+    for (auto& layout : LAYOUTS) {
+      recovery(layout, backlog);
+    }
+  }
+}
+
+// loop() runs over and over again, as quickly as it can execute.
+void loop() {
+  delay(1000);
+}
@@ -0,0 +1,69 @@
+/*
+ * Project index
+ * Description: Compare the RAM held by the queue index against the backlog size for each queue layout
+ * Author:
+ * Date:
+ */
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+SerialLogHandler logHandler(115200, LOG_LEVEL_TRACE);
+
+static const size_t ITEM_SIZE = 32;
+static const size_t BACKLOGS[] = { 100, 1000, 5000 };
+
+// Fill a queue with a backlog, restart it and report the index memory before and after
+static void benchmark(const char* name, size_t backlog, size_t segmentSize, bool varySize) {
+  DiskQueue queue(1024 * 1024);
+  queue.setSegmentSize(segmentSize);
+  int rc = queue.start("/index");
+  if (SYSTEM_ERROR_NONE != rc) {
+    Log.error("%s start: %d", name, rc);
+    return;
+  }
+  queue.unlinkFiles();
+  queue.stop();
+  queue.start("/index");
+
+  uint8_t item[ITEM_SIZE + 1] = {};
+  for (size_t i = 0; i < backlog; i++) {
+    // Alternating sizes keep neighbouring files from sharing an index entry
+    size_t size = (varySize && (i & 1)) ? ITEM_SIZE + 1 : ITEM_SIZE;
+    memset(item, (int)i, sizeof(item));
+    queue.pushBack(item, size);
+  }
+  auto filled = queue.getStats();
+
+  // Restarting rebuilds the index from the directory listing
+  queue.stop();
+  auto start = millis();
+  queue.start("/index");
+  auto elapsed = millis() - start;
+  auto restarted = queue.getStats();
+
+  Log.info("%s, %u items: %u files, %u entries, %u bytes, after restart %u entries, %u bytes in %lu ms",
+    name, restarted.itemsTotal, restarted.filesTotal, filled.indexEntries, filled.indexBytes,
+    restarted.indexEntries, restarted.indexBytes, (unsigned long)elapsed);
+
+  queue.unlinkFiles();
+  queue.stop();
+}
+
+// setup() runs once, when the device is first turned on.
+void setup() {
+  delay(3000);
+  for (auto backlog : BACKLOGS) {
+    benchmark("file per item", backlog, 0, false);
+    benchmark("file per item, mixed sizes", backlog, 0, true);
+    benchmark("4k segments", backlog, 4096, false);
+  }
+}
+
+// loop() runs over and over again, as quickly as it can execute.
+void loop() {
+  delay(1000);
+}
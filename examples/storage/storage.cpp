@@ -0,0 +1,65 @@
+/*
+ * Project storage
+ * Description: Compare the flash cost of queue layouts using the simulated flash storage
+ * Author:
+ * Date:
+ */
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+SerialLogHandler logHandler(115200, LOG_LEVEL_TRACE);
+
+static const size_t ITEM_COUNT = 200;
+static const size_t ITEM_SIZE = 48;
+
+// Push and pop a fixed workload and report what it cost the simulated flash
+static void benchmark(const char* name, size_t segmentSize, float compactionRatio) {
+  DiskQueueFlashStorage flash;
+  DiskQueue queue(64 * 1024);
+  queue.setStorage(&flash);
+  queue.setSegmentSize(segmentSize);
+  queue.setCompaction(compactionRatio);
+  int rc = queue.start("/bench");
+  if (SYSTEM_ERROR_NONE != rc) {
+    Log.error("%s start: %d", name, rc);
+    return;
+  }
+
+  uint8_t item[ITEM_SIZE] = {};
+  for (size_t i = 0; i < ITEM_COUNT; i++) {
+    memset(item, (int)i, sizeof(item));
+    queue.pushBack(item, sizeof(item));
+
+    // Consume every other item so that the queue holds a backlog with holes
+    if (i & 1) {
+      queue.popFront();
+    }
+  }
+  while (!queue.isEmpty()) {
+    queue.popFront();
+  }
+  queue.stop();
+
+  auto stats = flash.getStats();
+  Log.info("%s: %lu ms, %u bytes, %u pages, %u erases, %u syncs", name,
+    (unsigned long)(stats.elapsedUs / 1000), stats.bytesWritten, stats.pagesProgrammed,
+    stats.blocksErased, stats.syncs);
+}
+
+// setup() runs once, when the device is first turned on.
+void setup() {
+  delay(3000);
+  benchmark("file per item", 0, 0.0f);
+  benchmark("1k segments", 1024, 0.0f);
+  benchmark("4k segments", 4096, 0.0f);
+  benchmark("4k segments compacted", 4096, 0.5f);
+}
+
+// loop() runs over and over again, as quickly as it can execute.
+void loop() {
+  delay(1000);
+}
@@ -0,0 +1,67 @@
+/*
+ * Project typed
+ * Description: Queue fixed size records and a keyed latest-value record with TypedDiskQueue
+ * Author:
+ * Date:
+ */
+
+#include "Particle.h"
+#include "TypedDiskQueue.h"
+
+SYSTEM_THREAD(ENABLED);
+SYSTEM_MODE(SEMI_AUTOMATIC);
+
+struct Sample {
+  uint32_t timestamp;
+  int16_t temperature;
+  uint16_t battery;
+};
+
+// Sample is trivially copyable so it is stored as its raw bytes in compact records
+TypedDiskQueue<Sample> gq(4096);
+
+SerialLogHandler logHandler(115200, LOG_LEVEL_TRACE);
+
+static const uint32_t LATEST_SAMPLE_KEY = 1;
+
+// pause user app execution
+static void park() {
+  while(true) {
+    delay(100);
+  }
+}
+
+// setup() runs once, when the device is first turned on.
+void setup() {
+  delay(3000);
+  gq.setSegmentSize(512);
+  gq.setCoalescing(true);
+  int rc = gq.start("/my_typed_cache");
+  Log.info("gq start: %d", rc);
+  if (SYSTEM_ERROR_NONE != rc) {
+    park();
+  }
+}
+
+static uint32_t loop_count = 0;
+
+// loop() runs over and over again, as quickly as it can execute.
+void loop() {
+  Sample sample = { (uint32_t)Time.now(), (int16_t)(loop_count % 40), (uint16_t)(4200 - (loop_count % 100)) };
+
+  // Every tenth sample only the newest one is kept
+  bool pushed = (0 == (loop_count % 10)) ? gq.pushBackKeyed(sample, LATEST_SAMPLE_KEY) : gq.pushBack(sample);
+  if (!pushed) {
+    Log.warn("pushback failed");
+  }
+  loop_count++;
+
+  if (gq.size() > 3) {
+    Sample front = {};
+    if (gq.peekFront(front)) {
+      Log.info("Read %lu: %d C %u mV", front.timestamp, front.temperature, front.battery);
+      gq.popFront();
+    }
+  }
+  delay(10);
+}
@@ -15,32 +15,114 @@
  */
 
 #include "DiskQueue.h"
-#include <fcntl.h>
-#include <dirent.h>
+#include "DiskQueueTrace.h"
+#include <errno.h>
 
 // TODO
 // * peekFront() after peekFrontSize() problem
 // * Handle pushBack() policy for DiskQueuePolicy::FifoDeleteNew
 
 int DiskQueue::start(const char* path, DiskQueuePolicy policy) {
+    DISKQUEUE_TRACE_SCOPE("start");
+
     // Check if already running
     CHECK_FALSE(_running, SYSTEM_ERROR_INVALID_STATE);
 
     // The lock here is to prevent the reader and writer from running
+    DISKQUEUE_TRACE_PHASE("lock");
     const std::lock_guard<RecursiveMutex> lock(_lock);
 
     int ret = SYSTEM_ERROR_UNKNOWN;
     do {
-        if (!dirExists(path) && mkdir(path, 0775)) {
+        // Queue file paths are formatted into fixed size buffers
+        if ((strlen(path) + FilenameSuffixMax) >= FilenameMax) {
+            ret = SYSTEM_ERROR_INVALID_ARGUMENT;
+            break;
+        }
+
+        DISKQUEUE_TRACE_PHASE("mkdir");
+        if (_storage->makeDirectory(path)) {
             ret = SYSTEM_ERROR_FILE;
             break;
         }
 
         _path = String(path) + "/";
 
+        // Preallocate index storage so that it does not grow while running.  The file list has
+        // room for one more file, written before the oldest is dropped to make room for it.
+        DISKQUEUE_TRACE_PHASE("reserve");
+        if ((0 < _fileCapacity) && !_fileList.reserve(_fileCapacity + 1)) {
+            ret = SYSTEM_ERROR_NO_MEMORY;
+            break;
+        }
+        if ((0 < _keyCapacity) && !_keyIndex.reserve(_keyCapacity)) {
+            ret = SYSTEM_ERROR_NO_MEMORY;
+            break;
+        }
+        if ((0 < _readAheadItems) &&
+            (!_readAhead.reserve(_readAheadItems) || !_readAheadData.resize(_readAheadBytes))) {
+            ret = SYSTEM_ERROR_NO_MEMORY;
+            break;
+        }
+
         // Create a list of all filenames that may contain previously saved data
+        DISKQUEUE_TRACE_PHASE("list");
         getFilenames(path);
 
+        // Files listed out of order may have been held in more entries than the merged ranges need
+        if ((0 == _fileCapacity) && fileRanges()) {
+            _fileList.trimToSize();
+        }
+
+        // Segments may hold several items and keys are only held in RAM so both must be
+        // recovered from the items on disk
+        DISKQUEUE_TRACE_PHASE("scan");
+        if ((0 < _segmentSize) || _coalescing) {
+            int i = 0;
+            while (i < _fileList.size()) {
+                unsigned long fileN = _fileList.at(i).n;
+                scanFile(fileN);
+
+                // Coalescing may have removed files ahead of this one
+                i = findFileNode(fileN);
+                if (0 == _fileList.at(i).count) {
+                    char toDelete[FilenameMax];
+                    formatFilename(toDelete, fileN);
+                    removeFileNode(i);
+                    _storage->remove(toDelete);
+                } else {
+                    ++i;
+                }
+            }
+        } else if (_segmentMarker) {
+            // Listed files are assumed to hold one item, which segment files written by a
+            // differently configured queue do not.  The directory is only marked while there
+            // may be some left.
+            bool segments = false;
+            int i = 0;
+            while (i < _fileList.size()) {
+                i = checkFileNode(i, segments);
+            }
+            if (!segments && !_storage->remove((_path + SegmentMarker).c_str())) {
+                _segmentMarker = false;
+            }
+        }
+
+        // The directory is marked before the first segment is written
+        DISKQUEUE_TRACE_PHASE("mark");
+        if ((0 < _segmentSize) && !_segmentMarker) {
+            auto fd = _storage->open((_path + SegmentMarker).c_str(), O_CREAT | O_RDWR);
+            if ((0 > fd) || _storage->sync(fd)) {
+                if (0 <= fd) {
+                    _storage->close(fd);
+                }
+                ret = SYSTEM_ERROR_FILE;
+                break;
+            }
+            _storage->close(fd);
+            _segmentMarker = true;
+        }
+
         _policy = policy;
         _running = true;
 
@@ -61,6 +143,27 @@ int DiskQueue::stop() {
     // Close all files and
     cleanupFiles();
 
+    // Release consumers waiting for items
+    _available.notify_all();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int DiskQueue::setStorage(DiskQueueStorage* storage) {
+    // Files cannot move between storages while open
+    CHECK_FALSE(_running, SYSTEM_ERROR_INVALID_STATE);
+
+    _storage = storage ? storage : &DiskQueuePosixStorage::instance();
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int DiskQueue::setCoalescing(bool enable) {
+    // The key index is built at start so the mode cannot change while running
+    CHECK_FALSE(_running, SYSTEM_ERROR_INVALID_STATE);
+
+    _coalescing = enable;
+
     return SYSTEM_ERROR_NONE;
 }
 
@@ -71,6 +174,94 @@ void DiskQueue::setDiskLimit(size_t size) {
     _diskLimit = size;
 }
 
+int DiskQueue::setCapacity(size_t files, size_t keys) {
+    // Storage is reserved at start so the capacity cannot change while running
+    CHECK_FALSE(_running, SYSTEM_ERROR_INVALID_STATE);
+
+    _fileCapacity = files;
+    _keyCapacity = keys;
+
+    return SYSTEM_ERROR_NONE;
+}
+
+int DiskQueue::setReadAhead(size_t items, size_t bytes) {
+    // The buffer is allocated at start so its size cannot change while running
+    CHECK_FALSE(_running, SYSTEM_ERROR_INVALID_STATE);
+
+    _readAheadItems = (0 < bytes) ? items : 0;
+    _readAheadBytes = (0 < items) ? bytes : 0;
+    if (0 == _readAheadItems) {
+        _readAhead.clear();
+        _readAheadData.clear();
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+size_t DiskQueue::readAhead() {
+    CHECK_TRUE(_running, 0);
+
+    // The lock here is to prevent the writer and reader from changing the items being read
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    getReadAheadFront(false);
+    return fillReadAhead();
+}
+
+void DiskQueue::setSegmentSize(size_t size) {
+    // The lock here is to prevent segment size updates from affecting the writer
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    _segmentSize = size;
+}
+
+void DiskQueue::setRecordSize(size_t size) {
+    // The lock here is to prevent record size updates from affecting the writer
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    _recordSize = size;
+}
+
+void DiskQueue::setCompaction(float deadRatio, size_t stepSize) {
+    // The lock here is to prevent compaction updates from affecting a step in progress
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    _compactionRatio = deadRatio;
+    _compactionStep = stepSize;
+}
+
+bool DiskQueue::compact(size_t budget) {
+    CHECK_TRUE(_running, false);
+
+    // The lock here is to prevent the reader and writer from changing the segment being copied
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    // Without automatic compaction any segment with holes may be picked
+    if (!_compaction.active && !selectCompaction(_compactionRatio)) {
+        return false;
+    }
+    return compactStep(budget);
+}
+
+DiskQueueStats DiskQueue::getStats() {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    DiskQueueStats stats = _stats;
+    stats.filesTotal = _fileCount;
+    stats.itemsTotal = _itemCount;
+    stats.deadBytes = 0;
+    for (auto item = _fileList.begin(); _fileList.end() != item; ++item) {
+        stats.deadBytes += item->dead;
+    }
+    stats.compactionActive = _compaction.active;
+    stats.readAheadItems = (size_t)_readAhead.size();
+    stats.indexEntries = (size_t)_fileList.size();
+    stats.indexBytes = (size_t)_fileList.capacity() * sizeof(FileEntry) +
+                       (size_t)_keyIndex.capacity() * sizeof(KeyEntry);
+
+    return stats;
+}
+
 int DiskQueue::getReadPolicyIndex(DiskQueuePolicy policy) {
     return 0; // Will always be the first for now
 }
@@ -91,132 +282,185 @@ int DiskQueue::getWriteOverflowPolicyIndex(DiskQueuePolicy policy) {
     return ret;
 }
 
-size_t DiskQueue::peekFrontSize() {
-    CHECK_TRUE(_running, 0);
+bool DiskQueue::readFileHeader(int fd, QueueFileHeader& header, uint16_t& length) {
+    auto ret = _storage->read(fd, &header, sizeof(header));
+    if (((int)sizeof(header) > ret) ||
+        (QueueFileMagic != header.magic)) {
+        return false;
+    }
 
-    // The lock here is to prevent the writer from catching up with the reader
-    const std::lock_guard<RecursiveMutex> lock(_lock);
+    length = 0;
+    if (QueueFileVersion1 == header.version) {
+        return true;
+    }
+
+    // Only compact files carry the version 2 header extension
+    QueueCompactHeader compactHeader = {};
+    if ((QueueFileVersion2 != header.version) ||
+        (0 == (FileFlagCompact & header.flags))) {
+        return false;
+    }
+    ret = _storage->read(fd, &compactHeader, sizeof(compactHeader));
+    if (((int)sizeof(compactHeader) > ret) ||
+        (0 == compactHeader.length)) {
+        return false;
+    }
+    length = compactHeader.length;
 
-    size_t size = 0;
+    return true;
+}
 
-    while (true) {
-        if (_fileList.isEmpty()) {
-            break; // Nothing available
+bool DiskQueue::readItemHeader(int fd, uint16_t length, QueueItemHeader& header, uint32_t& key) {
+    if (length) {
+        // Compact records only keep the flags byte, the rest is implied by the file
+        uint8_t flags = 0;
+        auto ret = _storage->read(fd, &flags, sizeof(flags));
+        if (((int)sizeof(flags) > ret) ||
+            (0 != (flags & ~(ItemFlagActive | ItemFlagKeyed)))) {
+            return false;
+        }
+        header = { QueueItemMagic, flags, length };
+    } else {
+        auto ret = _storage->read(fd, &header, sizeof(header));
+        if (((int)sizeof(header) > ret) ||
+            (QueueItemMagic != header.magic)) {
+            return false;
         }
+    }
+
+    key = 0;
+    if (ItemFlagKeyed & header.flags) {
+        auto ret = _storage->read(fd, &key, sizeof(key));
+        if ((int)sizeof(key) > ret) {
+            return false;
+        }
+    }
 
-        auto entry = _fileList.first(); // TODO: Apply policy
+    return true;
+}
+
+int DiskQueue::openFront(QueueItemHeader& header, uint32_t& key) {
+    while (!_fileList.isEmpty()) {
+        auto entry = &_fileList.first(); // TODO: Apply policy
         unsigned long fileN = entry->n;
-        String filename = _path + String(fileN);
+        char filename[FilenameMax];
+        formatFilename(filename, fileN);
 
-        auto fd = open(filename.c_str(), O_RDWR, 0664);
+        auto fd = _storage->open(filename, O_RDWR);
         if (0 > fd) {
             // File open is unsuccessful so remove file and continue
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
+            removeFile(getReadPolicyIndex(_policy), false);
             continue;
         }
 
         // Get the file header
         QueueFileHeader fileHeader = {};
-        auto ret = read(fd, &fileHeader, sizeof(fileHeader));
-        if (((int)sizeof(fileHeader) > ret) ||
-            (QueueFileMagic != fileHeader.magic) ||
-            (QueueFileVersion1 != fileHeader.version)) {
-
-            close(fd);
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
+        if (!readFileHeader(fd, fileHeader, entry->length)) {
+            _storage->close(fd);
+            removeFile(getReadPolicyIndex(_policy), false);
             continue;
         }
 
-        // Get the item header
-        QueueItemHeader itemHeader = {};
-        ret = read(fd, &itemHeader, sizeof(itemHeader));
-        if (((int)sizeof(itemHeader) > ret) ||
-            (QueueItemMagic != itemHeader.magic) ||
-            (0 == (ItemFlagActive & itemHeader.flags))) {
-
-            close(fd);
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
-            continue;
+        // Get the first active item header, skipping items that were consumed or tombstoned
+        size_t offset = fileHeaderSize(entry->length);
+        entry->head = std::max<size_t>(entry->head, offset);
+        while (entry->head < entry->size) {
+            if ((entry->head != offset) &&
+                ((off_t)entry->head != _storage->seek(fd, entry->head))) {
+                break;
+            }
+            if (!readItemHeader(fd, entry->length, header, key) ||
+                ((entry->head + itemRecordSize(header, entry->length)) > entry->size)) {
+                break;
+            }
+            if (ItemFlagActive & header.flags) {
+                return fd;
+            }
+            // The file position is now just past the header and key of the skipped item
+            offset = entry->head + itemRecordSize(header, entry->length) - header.length;
+            entry->head += itemRecordSize(header, entry->length);
         }
 
-        // Everything was successful
-        close(fd);
-        size = (size_t)itemHeader.length;
-        break;
+        // The file is either exhausted or corrupt past this point
+        _storage->close(fd);
+        removeFile(getReadPolicyIndex(_policy), false);
+    }
+
+    return -1;
+}
+
+size_t DiskQueue::peekFrontSize() {
+    DISKQUEUE_TRACE_SCOPE("peekFrontSize");
+
+    CHECK_TRUE(_running, 0);
+
+    // The lock here is to prevent the writer from catching up with the reader
+    DISKQUEUE_TRACE_PHASE("lock");
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    DISKQUEUE_TRACE_PHASE("readAhead");
+    auto front = getReadAheadFront(true);
+    if (front) {
+        return (size_t)front->length;
     }
 
-    return size;
+    QueueItemHeader itemHeader = {};
+    uint32_t key = 0;
+    DISKQUEUE_TRACE_PHASE("open");
+    auto fd = openFront(itemHeader, key);
+    if (0 > fd) {
+        return 0; // Nothing available
+    }
+
+    DISKQUEUE_TRACE_PHASE("close");
+    _storage->close(fd);
+    return (size_t)itemHeader.length;
 }
 
 // TODO: given size may be derived from peekFrontSize but this function may advance forward to another
 //       entry until successful
 bool DiskQueue::peekFront(uint8_t* data, size_t& size) {
+    DISKQUEUE_TRACE_SCOPE("peekFront");
+
     CHECK_TRUE(_running, false);
 
     // The lock here is to prevent the writer from catching up with the reader
+    DISKQUEUE_TRACE_PHASE("lock");
     const std::lock_guard<RecursiveMutex> lock(_lock);
 
+    DISKQUEUE_TRACE_PHASE("readAhead");
+    auto front = getReadAheadFront(true);
+    if (front) {
+        size = std::min<size_t>(size, (size_t)front->length);
+        memcpy(data, _readAheadData.data() + front->pos, size);
+        return true;
+    }
+
     auto success = false;
 
     while (true) {
-        if (_fileList.isEmpty()) {
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        DISKQUEUE_TRACE_PHASE("open");
+        auto fd = openFront(itemHeader, key);
+        if (0 > fd) {
             size = 0;
             break; // Nothing available
         }
 
-        auto entry = _fileList.first(); // TODO: Apply policy
-        unsigned long fileN = entry->n;
-        String filename = _path + String(fileN);
-
-        auto fd = open(filename.c_str(), O_RDWR, 0664);
-        if (0 > fd) {
-            // File open is unsuccessful so remove file and continue
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
-            continue;
-        }
-
-        // Get the file header
-        QueueFileHeader fileHeader = {};
-        auto ret = read(fd, &fileHeader, sizeof(fileHeader));
-        if (((int)sizeof(fileHeader) > ret) ||
-            (QueueFileMagic != fileHeader.magic) ||
-            (QueueFileVersion1 != fileHeader.version)) {
-
-            close(fd);
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
-            continue;
-        }
-
-        // Get the item header
-        QueueItemHeader itemHeader = {};
-        ret = read(fd, &itemHeader, sizeof(itemHeader));
-        if (((int)sizeof(itemHeader) > ret) ||
-            (QueueItemMagic != itemHeader.magic) ||
-            (0 == (ItemFlagActive & itemHeader.flags))) {
-
-            close(fd);
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
-            continue;
-        }
-
         // Get the data
+        DISKQUEUE_TRACE_PHASE("read");
         auto toRead = std::min<size_t>(size, (size_t)itemHeader.length);
-        ret = read(fd, data, toRead);
+        auto ret = _storage->read(fd, data, toRead);
         if ((int)toRead > ret) {
-            close(fd);
-            unlink(filename.c_str());
-            removeFileNode(getReadPolicyIndex(_policy));
+            _storage->close(fd);
+            removeFile(getReadPolicyIndex(_policy), false);
             continue;
         }
 
         // Everything was successful
-        close(fd);
+        DISKQUEUE_TRACE_PHASE("close");
+        _storage->close(fd);
         success = true;
         size = (size_t)toRead;
         break;
@@ -225,90 +469,320 @@ bool DiskQueue::peekFront(uint8_t* data, size_t& size) {
     return success;
 }
 
+bool DiskQueue::peekFront(uint8_t* data, size_t& size, system_tick_t timeout) {
+    CHECK_TRUE(_running, false);
+
+    // Waiting releases the lock so the writer can push, it must not be held by the caller
+    std::unique_lock<RecursiveMutex> lock(_lock);
+
+    auto start = millis();
+    auto capacity = size;
+    while (true) {
+        system_tick_t elapsed = millis() - start;
+        if ((elapsed > timeout) ||
+            !_available.wait_for(lock, std::chrono::milliseconds(timeout - elapsed), [this]() {
+                return !_running || !_fileList.isEmpty();
+            }) ||
+            !_running) {
+            size = 0;
+            return false;
+        }
+
+        // Unreadable items are discarded by peekFront() so the queue is empty again if this fails
+        size = capacity;
+        if (peekFront(data, size)) {
+            return true;
+        }
+    }
+}
+
+bool DiskQueue::waitFront(system_tick_t timeout) {
+    CHECK_TRUE(_running, false);
+
+    // Waiting releases the lock so the writer can push, it must not be held by the caller
+    std::unique_lock<RecursiveMutex> lock(_lock);
+
+    return _available.wait_for(lock, std::chrono::milliseconds(timeout), [this]() {
+        return !_running || !_fileList.isEmpty();
+    }) && _running;
+}
+
 void DiskQueue::popFront() {
+    DISKQUEUE_TRACE_SCOPE("popFront");
+
     if (!_running) {
         return;
     }
 
     // The lock here is to prevent the writer from catching up with the reader
+    DISKQUEUE_TRACE_PHASE("lock");
     const std::lock_guard<RecursiveMutex> lock(_lock);
 
     if (_fileList.isEmpty()) {
         return; // Nothing available
     }
 
-    auto entry = _fileList.first(); // TODO: Apply policy
-    unsigned long fileN = entry->n;
-    String filename = _path + String(fileN);
+    // Files holding a single active item are removed without being read
+    auto entry = &_fileList.first(); // TODO: Apply policy
+    if ((1 < entry->count) && (1 == entry->files)) {
+        QueueItemHeader itemHeader = {};
+        size_t offset = 0;
+        int fd = -1;
+
+        // A front item that was read ahead has already been located
+        DISKQUEUE_TRACE_PHASE("open");
+        auto front = getReadAheadFront(false);
+        if (front) {
+            char filename[FilenameMax];
+            formatFilename(filename, entry->n);
+            fd = _storage->open(filename, O_RDWR);
+            itemHeader = { QueueItemMagic, front->flags, front->length };
+            offset = front->offset;
+        }
+
+        if (0 > fd) {
+            uint32_t key = 0;
+            fd = openFront(itemHeader, key);
+            if (0 > fd) {
+                return; // Nothing available
+            }
+            entry = &_fileList.first();
+            offset = entry->head;
+        }
+
+        if ((1 < entry->count) && (1 == entry->files)) {
+            // Mark the item consumed in place so that it is not read again after a restart
+            DISKQUEUE_TRACE_PHASE("write");
+            if (!clearActiveFlag(fd, offset, itemHeader.flags, entry->length)) {
+                // Left at the front rather than coming back after a restart
+                _storage->close(fd);
+                return;
+            }
+            DISKQUEUE_TRACE_PHASE("fsync");
+            _storage->sync(fd);
+            DISKQUEUE_TRACE_PHASE("close");
+            _storage->close(fd);
+
+            auto recordSize = itemRecordSize(itemHeader, entry->length);
+            checkCompaction(entry->n, offset);
+            removeKey(entry->n, offset);
+            removeReadAhead(entry->n, offset);
+            // Items between the head and this one, if any, were already inactive
+            entry->head = offset + recordSize;
+            entry->dead += recordSize;
+            entry->count--;
+            _itemCount--;
+
+            DISKQUEUE_TRACE_PHASE("compact");
+            if (0.0f < _compactionRatio) {
+                compactStep(_compactionStep);
+            }
+            return;
+        }
+        _storage->close(fd);
+    }
+
+    DISKQUEUE_TRACE_PHASE("unlink");
+    removeFile(getReadPolicyIndex(_policy), false);
 
-    unlink(filename.c_str());
-    removeFileNode(getReadPolicyIndex(_policy));
+    DISKQUEUE_TRACE_PHASE("compact");
+    if (0.0f < _compactionRatio) {
+        compactStep(_compactionStep);
+    }
 }
 
 bool DiskQueue::pushBack(const uint8_t* data, size_t size) {
+    return pushItem(data, size, false, 0);
+}
+
+bool DiskQueue::pushBackKeyed(const uint8_t* data, size_t size, uint32_t key) {
+    return pushItem(data, size, true, key);
+}
+
+bool DiskQueue::pushItem(const uint8_t* data, size_t size, bool keyed, uint32_t key) {
+    DISKQUEUE_TRACE_SCOPE("pushBack");
+
     CHECK_TRUE(_running, false);
     CHECK_TRUE((0 != size), false);
+    // Item lengths are stored in 16 bits
+    CHECK_TRUE((UINT16_MAX >= size), false);
     // A disk limit of zero means that no new items can be enqueued
     CHECK_TRUE((0 < _diskLimit), false);
 
     // The lock here is to prevent the reader from catching up with the writer
+    DISKQUEUE_TRACE_PHASE("lock");
     const std::lock_guard<RecursiveMutex> lock(_lock);
 
+    // Items of the configured record size are written as compact records
+    uint16_t length = ((0 < _recordSize) && (_recordSize == size)) ? (uint16_t)size : 0;
+    uint8_t flags = keyed ? (ItemFlagActive | ItemFlagKeyed) : ItemFlagActive;
+    QueueItemHeader itemHeader = { QueueItemMagic, flags, (uint16_t)size };
+    size_t keySize = keyed ? sizeof(key) : 0;
+    size_t recordSize = itemRecordSize(itemHeader, length);
+
+    // Segments are kept within half the disk limit so that evicting the oldest one to make room
+    // leaves the newer items in place
+    size_t segmentSize = std::min(_segmentSize, _diskLimit / 2);
+
+    // Append to the newest segment while it has room and the same record format, unless it is being compacted
+    FileEntry* tail = _fileList.isEmpty() ? nullptr : &_fileList.last();
+    bool append = (0 < segmentSize) &&
+                  tail &&
+                  (tail->length == length) &&
+                  ((tail->size + recordSize) <= segmentSize) &&
+                  !(_compaction.active && (_compaction.n == tail->n));
+
     unsigned long fileN = 0;
-    if (!_fileList.isEmpty()) {
-        fileN = _fileList.last()->n + 1;
+    if (tail) {
+        fileN = append ? tail->n : tail->n + tail->files;
     }
 
-    String filename = _path + String(fileN);
+    // With a fixed capacity the key index must not grow, so new keys are refused once it is full
+    DISKQUEUE_TRACE_PHASE("capacity");
+    if (_coalescing && keyed && (0 < _keyCapacity) && (_keyIndex.size() >= (int)_keyCapacity)) {
+        bool known = false;
+        for (auto item = _keyIndex.begin(); _keyIndex.end() != item; ++item) {
+            if (item->key == key) {
+                known = true;
+                break;
+            }
+        }
+        CHECK_TRUE(known, false);
+    }
+
+    // With a fixed capacity the file list must not grow.  As with the disk limit, the oldest files
+    // make room once the new item is written, or the new item is refused when deleting the newest.
+    if (!append && (0 < _fileCapacity) && (_fileCount >= _fileCapacity)) {
+        CHECK_TRUE(DiskQueuePolicy::FifoDeleteOld == _policy, false);
+    }
+
+    // A new file following the newest range with the same size only extends that range
+    size_t fileSize = recordSize + (append ? 0 : fileHeaderSize(length));
+    bool extend = !append && fileRanges() && tail && joinsRange(*tail, fileN, fileSize);
+
+    // Deleting the newest refuses an item that does not fit.  Once written it may share its
+    // segment with older items, which must not be dropped along with it.
+    CHECK_TRUE((DiskQueuePolicy::FifoDeleteOld == _policy) || ((_diskCurrent + fileSize) <= _diskLimit), false);
+
+    char filename[FilenameMax];
+    formatFilename(filename, fileN);
 
-    auto fd = open(filename.c_str(), O_CREAT | O_RDWR | O_APPEND, 0664);
+    DISKQUEUE_TRACE_PHASE("open");
+    auto fd = _storage->open(filename, O_CREAT | O_RDWR | O_APPEND);
     if (0 > fd) {
         return false;
     }
 
+    DISKQUEUE_TRACE_PHASE("write");
     do {
-        QueueFileHeader fileHeader = { QueueFileMagic, QueueFileVersion1, 0x00 /* no flags */ };
         size_t written = 0;
-        auto ret = write(fd, &fileHeader, sizeof(fileHeader));
-        if (0 >= ret) {
-            break;
+        if (!append) {
+            QueueFileHeader fileHeader = { QueueFileMagic, QueueFileVersion1, 0x00 /* no flags */ };
+            if (length) {
+                fileHeader = { QueueFileMagic, QueueFileVersion2, FileFlagCompact };
+            }
+            auto ret = _storage->write(fd, &fileHeader, sizeof(fileHeader));
+            if (0 >= ret) {
+                break;
+            }
+            written += (size_t)ret;
+
+            if (length) {
+                QueueCompactHeader compactHeader = { length };
+                ret = _storage->write(fd, &compactHeader, sizeof(compactHeader));
+                if (0 >= ret) {
+                    break;
+                }
+                written += (size_t)ret;
+            }
         }
-        written += (size_t)ret;
 
-        QueueItemHeader itemHeader = { QueueItemMagic, ItemFlagActive, (uint16_t)size };
-        ret = write(fd, &itemHeader, sizeof(itemHeader));
+        // Compact records drop the magic and length of the item header
+        auto ret = length ? _storage->write(fd, &itemHeader.flags, sizeof(itemHeader.flags)) :
+                            _storage->write(fd, &itemHeader, sizeof(itemHeader));
         if (0 >= ret) {
             break;
         }
         written += (size_t)ret;
 
-        ret = write(fd, data, size);
+        if (keyed) {
+            ret = _storage->write(fd, &key, keySize);
+            if (0 >= ret) {
+                break;
+            }
+            written += (size_t)ret;
+        }
+
+        ret = _storage->write(fd, data, size);
         if (0 >= ret) {
             break;
         }
         written += (size_t)ret;
 
-        size_t fileSize = sizeof(fileHeader) + sizeof(itemHeader) + size;
         if ((size_t)written != fileSize) {
             break;
         }
 
-        fsync(fd);
-        close(fd);
-        addFileNode(fileN, fileSize);
+        DISKQUEUE_TRACE_PHASE("fsync");
+        _storage->sync(fd);
+        DISKQUEUE_TRACE_PHASE("close");
+        _storage->close(fd);
+
+        size_t offset = fileHeaderSize(length);
+        if (append) {
+            offset = tail->size;
+            tail->size += recordSize;
+            tail->count++;
+            _itemCount++;
+            _diskCurrent += recordSize;
+        } else if (extend) {
+            tail->size += fileSize;
+            tail->count++;
+            tail->files++;
+            _itemCount++;
+            _fileCount++;
+            _diskCurrent += fileSize;
+        } else {
+            auto entry = addFileNode(fileN, fileSize);
+            if (entry) {
+                entry->head = offset;
+                entry->length = length;
+            }
+        }
+
+        // The new item is durable so any older item with the same key can now be dropped
+        DISKQUEUE_TRACE_PHASE("coalesce");
+        if (_coalescing && keyed) {
+            coalesceKey(key, fileN, offset);
+        }
 
-        while (_diskCurrent > _diskLimit) {
-            auto index = getWriteOverflowPolicyIndex(_policy);
-            auto entry = _fileList.at(index);
-            String toDelete = _path + String(entry->n);
-            removeFileNode(index);
-            unlink(toDelete.c_str());
+        // The oldest files make room for the new item, but the file holding it is kept
+        DISKQUEUE_TRACE_PHASE("evict");
+        while (((_diskCurrent > _diskLimit) || ((0 < _fileCapacity) && (_fileCount > _fileCapacity))) &&
+               !_fileList.isEmpty() && (_fileList.first().n != fileN)) {
+            removeFile(getWriteOverflowPolicyIndex(_policy), false);
+        }
+
+        DISKQUEUE_TRACE_PHASE("compact");
+        if (0.0f < _compactionRatio) {
+            compactStep(_compactionStep);
         }
+
+        // Wake consumers waiting for an item
+        DISKQUEUE_TRACE_PHASE("notify");
+        _available.notify_all();
         return true;
     } while (false);
 
-    close(fd);
-    unlink(filename.c_str());
+    DISKQUEUE_TRACE_PHASE("rollback");
+    if (append) {
+        // Drop the partial record so that the segment stays parseable
+        _storage->truncate(fd, tail->size);
+        _storage->close(fd);
+    } else {
+        _storage->close(fd);
+        _storage->remove(filename);
+    }
     return false;
 }
 
@@ -321,72 +795,334 @@ bool DiskQueue::pushBack(const String& data) {
     return pushBack((uint8_t*)data.c_str(), (size_t)data.length());
 }
 
-/**
- * @brief Get list of file numbers that represent disk queue data filenames.
- *
- * @return Vector<unsigned long> An array of the file numbers.
- */
-Vector<unsigned long> DiskQueue::list() {
-    Vector<unsigned long> fileList;
-
-    for (auto item = _fileList.begin();item != _fileList.end();++item) {
-        fileList.append((*item)->n);
-    }
+bool DiskQueue::pushBackKeyed(const char* data, uint32_t key) {
+    auto size = strlen(data);
+    return pushBackKeyed((uint8_t*)data, size, key);
+}
 
-    return fileList;
+bool DiskQueue::pushBackKeyed(const String& data, uint32_t key) {
+    return pushBackKeyed((uint8_t*)data.c_str(), (size_t)data.length(), key);
 }
 
-bool DiskQueue::dirExists(const char* path) {
-    struct stat st = {};
-    if (!stat(path, &st)) {
-        if (S_ISDIR(st.st_mode)) {
-            return true;
+// Export target writing the stream to a file descriptor of the operating system
+static int writeDescriptor(const uint8_t* data, size_t size, void* context) {
+    int fd = *static_cast<int*>(context);
+    while (0 < size) {
+        auto ret = ::write(fd, data, size);
+        if (0 >= ret) {
+            return SYSTEM_ERROR_IO;
         }
+        data += ret;
+        size -= ret;
     }
 
-    return false;
+    return SYSTEM_ERROR_NONE;
 }
 
-int DiskQueue::sortPartition(Vector<FileEntry*>& array, int begin, int end) {
-    FileEntry* last = array[end];
-    int pivot = (begin - 1);
+int DiskQueue::exportItems(int fd, size_t first, size_t count) {
+    CHECK_TRUE(0 <= fd, SYSTEM_ERROR_INVALID_ARGUMENT);
 
-    for (int i = begin; i <= (end - 1); ++i) {
-        if (array[i]->n <= last->n) {
-            std::swap<FileEntry*>(array[++pivot], array[i]);
-        }
-    }
-    std::swap<FileEntry*>(array[pivot + 1], array[end]);
+    ExportJob job = { fd, writeDescriptor, nullptr, first, count, 0, 0, 0, 0 };
+    job.context = &job.fd;
+    return exportRange(job, false);
+}
 
-    return (pivot + 1);
+int DiskQueue::exportItems(DiskQueueExportCallback callback, void* context, size_t first, size_t count) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
+
+    ExportJob job = { -1, callback, context, first, count, 0, 0, 0, 0 };
+    return exportRange(job, false);
 }
 
-void DiskQueue::quickSortFiles(Vector<FileEntry*>& array, int begin, int end)
-{
-    if (array.isEmpty()) {
-        // Done
-        return;
-    }
+int DiskQueue::drainItems(int fd, size_t count) {
+    CHECK_TRUE(0 <= fd, SYSTEM_ERROR_INVALID_ARGUMENT);
 
-    Vector<int> stack(end - begin + 1, 0);
+    ExportJob job = { fd, writeDescriptor, nullptr, 0, count, 0, 0, 0, 0 };
+    job.context = &job.fd;
+    return exportRange(job, true);
+}
 
-    int top = -1;
+int DiskQueue::drainItems(DiskQueueExportCallback callback, void* context, size_t count) {
+    CHECK_TRUE(callback, SYSTEM_ERROR_INVALID_ARGUMENT);
 
-    stack[++top] = begin;
-    stack[++top] = end;
+    ExportJob job = { -1, callback, context, 0, count, 0, 0, 0, 0 };
+    return exportRange(job, true);
+}
 
-    while (0 <= top) {
-        end = stack[top--];
-        begin = stack[top--];
+int DiskQueue::exportRange(ExportJob& job, bool drain) {
+    CHECK_TRUE(_running, SYSTEM_ERROR_INVALID_STATE);
 
-        int pivot = sortPartition(array, begin, end);
+    // The lock here is to prevent the writer and reader from changing the queue between the export
+    // and the removal of the exported items
+    const std::lock_guard<RecursiveMutex> lock(_lock);
 
-        if ((pivot - 1) > begin) {
-            stack[++top] = begin;
-            stack[++top] = pivot - 1;
+    for (int i = 0; (i < _fileList.size()) && (job.exported < job.count); ++i) {
+        // Files entirely ahead of the range are skipped without being read
+        auto entry = &_fileList.at(i);
+        if ((job.position + entry->count) <= job.first) {
+            job.position += entry->count;
+            continue;
         }
 
-        if ((pivot + 1) < end) {
+        // Each file of a range holds a single item so those ahead of the range are skipped by number
+        unsigned skip = 0;
+        if ((1 < entry->files) && (job.position < job.first)) {
+            skip = (unsigned)(job.first - job.position);
+            job.position += skip;
+        }
+
+        size_t fileSize = entry->size / entry->files;
+        for (unsigned k = skip; (k < entry->files) && (job.exported < job.count); ++k) {
+            auto ret = exportFile(job, entry->n + k, k ? 0 : entry->head, fileSize);
+            if (SYSTEM_ERROR_NONE != ret) {
+                return ret;
+            }
+        }
+    }
+
+    if (!drain) {
+        return (int)job.exported;
+    }
+
+    // Exported items must have reached the target file before they are removed.  Pipes and sockets
+    // cannot be synced.
+    if ((0 <= job.fd) && ::fsync(job.fd) && (EINVAL != errno)) {
+        return SYSTEM_ERROR_IO;
+    }
+
+    // Files were skipped if they could not be read, so the removal goes by the location of the
+    // last item exported rather than by the number of items
+    while ((0 < job.exported) && !_fileList.isEmpty()) {
+        auto entry = &_fileList.first();
+        if (entry->n > job.lastN) {
+            break;
+        }
+        if ((entry->n == job.lastN) && (1 == entry->files)) {
+            consumeItems(0, job.lastEnd);
+            break;
+        }
+
+        // Files ahead of the last item exported are removed without being rewritten
+        removeFile(getReadPolicyIndex(_policy), false);
+    }
+
+    if (0.0f < _compactionRatio) {
+        compactStep(_compactionStep);
+    }
+
+    return (int)job.exported;
+}
+
+int DiskQueue::exportFile(ExportJob& job, unsigned long n, size_t head, size_t size) {
+    char filename[FilenameMax];
+    formatFilename(filename, n);
+
+    auto fd = _storage->open(filename, O_RDONLY);
+    if (0 > fd) {
+        return SYSTEM_ERROR_NONE; // Left for the reader to discard
+    }
+
+    QueueFileHeader fileHeader = {};
+    uint16_t length = 0;
+    if (!readFileHeader(fd, fileHeader, length)) {
+        _storage->close(fd);
+        return SYSTEM_ERROR_NONE; // Left for the reader to discard
+    }
+
+    int ret = SYSTEM_ERROR_NONE;
+    size_t offset = std::max<size_t>(head, fileHeaderSize(length));
+    while ((SYSTEM_ERROR_NONE == ret) && (offset < size) && (job.exported < job.count)) {
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        if (((off_t)offset != _storage->seek(fd, offset)) ||
+            !readItemHeader(fd, length, itemHeader, key)) {
+            break;
+        }
+
+        auto recordSize = itemRecordSize(itemHeader, length);
+        if ((offset + recordSize) > size) {
+            break;
+        }
+
+        bool selected = false;
+        if (ItemFlagActive & itemHeader.flags) {
+            selected = (job.position >= job.first);
+            job.position++;
+        }
+
+        if (selected) {
+            // The flags byte on disk changes when the item is popped, which may happen before a
+            // pipe or socket has sent spliced file pages, so the framing is written from this copy.
+            // Compact records are given the full header they would carry in a regular file.
+            ret = job.callback((const uint8_t*)&itemHeader, sizeof(itemHeader), job.context);
+            if ((SYSTEM_ERROR_NONE == ret) && (ItemFlagKeyed & itemHeader.flags)) {
+                ret = job.callback((const uint8_t*)&key, sizeof(key), job.context);
+            }
+            if (SYSTEM_ERROR_NONE == ret) {
+                ret = exportTransfer(job, fd, offset + recordSize - itemHeader.length, itemHeader.length);
+            }
+            job.exported++;
+            job.lastN = n;
+            job.lastEnd = offset + recordSize;
+        }
+        offset += recordSize;
+    }
+
+    _storage->close(fd);
+
+    return ret;
+}
+
+int DiskQueue::exportTransfer(ExportJob& job, int fd, size_t offset, size_t size) {
+    if (0 == size) {
+        return SYSTEM_ERROR_NONE;
+    }
+
+    // The storage may copy straight to a file descriptor without passing the data through here
+    if (0 <= job.fd) {
+        return ((int)size == _storage->transfer(fd, offset, size, job.fd)) ? SYSTEM_ERROR_NONE : SYSTEM_ERROR_IO;
+    }
+
+    if ((off_t)offset != _storage->seek(fd, offset)) {
+        return SYSTEM_ERROR_IO;
+    }
+
+    uint8_t buffer[ExportCopySize];
+    while (0 < size) {
+        auto chunk = std::min(sizeof(buffer), size);
+        if ((int)chunk > _storage->read(fd, buffer, chunk)) {
+            return SYSTEM_ERROR_IO;
+        }
+        auto ret = job.callback(buffer, chunk, job.context);
+        if (SYSTEM_ERROR_NONE != ret) {
+            return ret;
+        }
+        size -= chunk;
+    }
+
+    return SYSTEM_ERROR_NONE;
+}
+
+void DiskQueue::consumeItems(int index, size_t end) {
+    auto entry = &_fileList.at(index);
+    unsigned long fileN = entry->n;
+    char filename[FilenameMax];
+    formatFilename(filename, fileN);
+
+    auto fd = _storage->open(filename, O_RDWR);
+    if (0 > fd) {
+        return;
+    }
+
+    QueueFileHeader fileHeader = {};
+    if (!readFileHeader(fd, fileHeader, entry->length)) {
+        _storage->close(fd);
+        return;
+    }
+
+    size_t offset = std::max<size_t>(entry->head, fileHeaderSize(entry->length));
+    while (offset < std::min(end, entry->size)) {
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        if (((off_t)offset != _storage->seek(fd, offset)) ||
+            !readItemHeader(fd, entry->length, itemHeader, key)) {
+            break;
+        }
+
+        auto recordSize = itemRecordSize(itemHeader, entry->length);
+        if ((offset + recordSize) > entry->size) {
+            break;
+        }
+
+        if (ItemFlagActive & itemHeader.flags) {
+            if (!clearActiveFlag(fd, offset, itemHeader.flags, entry->length)) {
+                break;
+            }
+            checkCompaction(fileN, offset);
+            removeKey(fileN, offset);
+            removeReadAhead(fileN, offset);
+            entry->dead += recordSize;
+            entry->count--;
+            _itemCount--;
+        }
+
+        // Every item ahead of the new head is now inactive
+        offset += recordSize;
+        entry->head = offset;
+    }
+
+    // A single sync covers all of the consumed items
+    _storage->sync(fd);
+    _storage->close(fd);
+
+    if (0 == entry->count) {
+        removeFileNode(index);
+        _storage->remove(filename);
+    }
+}
+
+/**
+ * @brief Get list of file numbers that represent disk queue data filenames.
+ *
+ * @return Vector<unsigned long> An array of the file numbers.
+ */
+Vector<unsigned long> DiskQueue::list() {
+    Vector<unsigned long> fileList;
+
+    for (auto item = _fileList.begin();item != _fileList.end();++item) {
+        for (unsigned k = 0; k < item->files; ++k) {
+            fileList.append(item->n + k);
+        }
+    }
+
+    return fileList;
+}
+
+void DiskQueue::formatFilename(char* filename, unsigned long n, const char* suffix) {
+    snprintf(filename, FilenameMax, "%s%lu%s", _path.c_str(), n, suffix);
+}
+
+int DiskQueue::sortPartition(Vector<FileEntry>& array, int begin, int end) {
+    unsigned long last = array[end].n;
+    int pivot = (begin - 1);
+
+    for (int i = begin; i <= (end - 1); ++i) {
+        if (array[i].n <= last) {
+            std::swap<FileEntry>(array[++pivot], array[i]);
+        }
+    }
+    std::swap<FileEntry>(array[pivot + 1], array[end]);
+
+    return (pivot + 1);
+}
+
+void DiskQueue::quickSortFiles(Vector<FileEntry>& array, int begin, int end)
+{
+    if (array.isEmpty()) {
+        // Done
+        return;
+    }
+
+    // Each pending range takes two slots
+    Vector<int> stack(2 * (end - begin + 1), 0);
+
+    int top = -1;
+
+    stack[++top] = begin;
+    stack[++top] = end;
+
+    while (0 <= top) {
+        end = stack[top--];
+        begin = stack[top--];
+
+        int pivot = sortPartition(array, begin, end);
+
+        if ((pivot - 1) > begin) {
+            stack[++top] = begin;
+            stack[++top] = pivot - 1;
+        }
+
+        if ((pivot + 1) < end) {
             stack[++top] = pivot + 1;
             stack[++top] = end;
         }
@@ -394,13 +1130,16 @@ void DiskQueue::quickSortFiles(Vector<FileEntry*>& array, int begin, int end)
 }
 
 void DiskQueue::cleanupFiles() {
-    if (!_fileList.isEmpty()) {
-        for (auto item = _fileList.begin(); _fileList.end() != item; ++item) {
-            removeFileNode(*item);
-        }
+    if (_compaction.active) {
+        abortCompaction();
     }
 
     _fileList.clear();
+    _keyIndex.clear();
+    _readAhead.clear();
+    _diskCurrent = 0;
+    _itemCount = 0;
+    _fileCount = 0;
 }
 
 void DiskQueue::unlinkFiles() {
@@ -409,15 +1148,18 @@ void DiskQueue::unlinkFiles() {
 
     if (!_fileList.isEmpty()) {
         for (auto item = _fileList.begin(); _fileList.end() != item; ++item) {
-
-            unsigned long fileN = (*item)->n;
-            String filename = _path + String(fileN);
-
-            auto fd = open(filename.c_str(), O_RDWR, 0664);
-            if(0 <= fd) {
-                // File open is succesfull so remove file and continue
-                unlink(filename.c_str());
-                continue;
+            for (unsigned k = 0; k < item->files; ++k) {
+                unsigned long fileN = item->n + k;
+                char filename[FilenameMax];
+                formatFilename(filename, fileN);
+
+                auto fd = _storage->open(filename, O_RDWR);
+                if(0 <= fd) {
+                    // File open is succesfull so remove file and continue
+                    _storage->close(fd);
+                    _storage->remove(filename);
+                    continue;
+                }
             }
         }
     }
@@ -426,67 +1168,797 @@ void DiskQueue::unlinkFiles() {
 void DiskQueue::cleanup() {
 }
 
-DiskQueue::FileEntry* DiskQueue::addFileNode(unsigned long n, size_t size, bool append) {
-    FileEntry* entry = new FileEntry;
-    if (!entry) {
+DiskQueue::FileEntry* DiskQueue::addFileNode(unsigned long n, size_t size) {
+    FileEntry entry = {};
+    entry.n = n;
+    entry.size = size;
+    entry.head = sizeof(QueueFileHeader);
+    entry.dead = 0;
+    entry.count = 1; // Until scanned every file is assumed to hold a single item
+    entry.length = 0;
+    entry.files = 1;
+
+    // Entries are stored by value so this only allocates if the list has to grow
+    if (!_fileList.append(entry)) {
         return nullptr;
     }
-    entry->n = n;
-    entry->size = size;
+    _diskCurrent += size;
+    _itemCount += entry.count;
+    _fileCount += entry.files;
 
-    if (append) {
-        _fileList.append(entry);
-        _diskCurrent += size;
+    return &_fileList.last();
+}
+
+bool DiskQueue::appendFileNode(unsigned long n, size_t size) {
+    if (_fileList.isEmpty() || !joinsRange(_fileList.last(), n, size)) {
+        return addFileNode(n, size) != nullptr;
     }
 
-    return entry;
+    auto entry = &_fileList.last();
+    entry->size += size;
+    entry->count++;
+    entry->files++;
+    _diskCurrent += size;
+    _itemCount++;
+    _fileCount++;
+
+    return true;
 }
 
-void DiskQueue::removeFileNode(FileEntry* entry) {
-    delete entry;
+void DiskQueue::mergeFileNodes() {
+    if (_fileList.isEmpty()) {
+        return;
+    }
+
+    // Neighbouring ranges of the same file size are merged in place
+    int last = 0;
+    for (int i = 1; i < _fileList.size(); ++i) {
+        auto prev = &_fileList.at(last);
+        auto entry = &_fileList.at(i);
+        if (((prev->n + prev->files) == entry->n) &&
+            (UINT16_MAX >= (prev->files + entry->files)) &&
+            ((prev->size * entry->files) == (entry->size * prev->files))) {
+            prev->size += entry->size;
+            prev->count += entry->count;
+            prev->files += entry->files;
+        } else {
+            _fileList.at(++last) = *entry;
+        }
+    }
+    _fileList.removeAt(last + 1, _fileList.size() - last - 1);
 }
 
 void DiskQueue::removeFileNode(int index) {
     if ((0 <= index) && (_fileList.size() > index)) {
-        auto entry = _fileList.at(index);
+        auto entry = &_fileList.at(index);
         if (_diskCurrent >= entry->size) {
             _diskCurrent -= entry->size;
         } else {
             // TODO: illegal, assert here?
             _diskCurrent = 0;
         }
-        removeFileNode(entry);
+        if (_itemCount >= entry->count) {
+            _itemCount -= entry->count;
+        } else {
+            _itemCount = 0;
+        }
+        _fileCount -= std::min<size_t>(_fileCount, entry->files);
+        if (_compaction.active && (_compaction.n == entry->n)) {
+            abortCompaction();
+        }
+        removeReadAheadFile(entry->n, false);
+        if (_coalescing) {
+            for (int i = 0; i < _keyIndex.size();) {
+                if (_keyIndex[i].n == entry->n) {
+                    _keyIndex.removeAt(i);
+                } else {
+                    ++i;
+                }
+            }
+        }
         _fileList.removeAt(index);
     }
 }
 
-int DiskQueue::getFilenames(const char* path) {
-    auto dir = opendir(path);
-    if (!dir) {
-        return SYSTEM_ERROR_NOT_FOUND;
+void DiskQueue::removeFile(int index, bool newest) {
+    if ((0 > index) || (_fileList.size() <= index)) {
+        return;
+    }
+
+    auto entry = &_fileList.at(index);
+    unsigned long fileN = newest ? (entry->n + entry->files - 1) : entry->n;
+    char filename[FilenameMax];
+    formatFilename(filename, fileN);
+    _storage->remove(filename);
+
+    if (1 == entry->files) {
+        removeFileNode(index);
+        return;
+    }
+
+    // Every file of a range holds a single item and takes an equal share of its size
+    size_t size = entry->size / entry->files;
+    entry->size -= size;
+    entry->count--;
+    entry->files--;
+    if (!newest) {
+        entry->n++;
+        entry->head = sizeof(QueueFileHeader);
+        entry->length = 0;
     }
+    _diskCurrent -= std::min(_diskCurrent, size);
+    _itemCount -= std::min<size_t>(_itemCount, 1);
+    _fileCount -= std::min<size_t>(_fileCount, 1);
+    removeReadAheadFile(fileN, false);
+}
+
+int DiskQueue::checkFileNode(int index, bool& segments) {
+    auto entry = &_fileList.at(index);
+    size_t fileSize = entry->size / entry->files;
 
-    struct dirent* ent = nullptr;
-    while (nullptr != (ent = readdir(dir))) {
-        if (DT_REG != ent->d_type) {
+    for (unsigned k = 0; k < entry->files; ++k) {
+        unsigned long fileN = entry->n + k;
+        if (holdsSingleItem(fileN, fileSize)) {
             continue;
         }
 
-        String filename = String(path) + "/" + String(ent->d_name);
-        struct stat st = {};
-        stat(filename.c_str(), &st);
+        // Split the file off its range, leaving the files before and after it in entries of their own
+        FileEntry file = {};
+        file.n = fileN;
+        file.size = fileSize;
+        file.head = sizeof(QueueFileHeader);
+        file.count = 1;
+        file.files = 1;
+        FileEntry after = file;
+        after.n = fileN + 1;
+        after.files = entry->files - k - 1;
+        after.size = after.files * fileSize;
+        after.count = after.files;
+
+        if (0 < k) {
+            if (!_fileList.insert(index + 1, file)) {
+                return index + 1;
+            }
+            entry = &_fileList.at(index++);
+            entry->files = k;
+            entry->size = k * fileSize;
+            entry->count = k;
+        } else {
+            *entry = file;
+        }
+        if ((0 < after.files) && !_fileList.insert(index + 1, after)) {
+            // Without room for the rest of the range the file is not split off after all
+            auto rest = &_fileList.at(index);
+            rest->files += after.files;
+            rest->size += after.size;
+            rest->count += after.count;
+            return index + 1;
+        }
+
+        scanFile(fileN);
+        if (0 == _fileList.at(index).count) {
+            char toDelete[FilenameMax];
+            formatFilename(toDelete, fileN);
+            removeFileNode(index);
+            _storage->remove(toDelete);
+            return index;
+        }
+        segments = true;
+        return index + 1;
+    }
+
+    return index + 1;
+}
+
+bool DiskQueue::holdsSingleItem(unsigned long n, size_t size) {
+    char filename[FilenameMax];
+    formatFilename(filename, n);
+    auto fd = _storage->open(filename, O_RDONLY);
+    if (0 > fd) {
+        return true;
+    }
+
+    QueueFileHeader fileHeader = {};
+    QueueItemHeader itemHeader = {};
+    uint16_t length = 0;
+    uint32_t key = 0;
+    bool single = !readFileHeader(fd, fileHeader, length) ||
+                  !readItemHeader(fd, length, itemHeader, key) ||
+                  ((ItemFlagActive & itemHeader.flags) &&
+                   ((fileHeaderSize(length) + itemRecordSize(itemHeader, length)) == size));
+    _storage->close(fd);
+
+    return single;
+}
+
+int DiskQueue::findFileNode(unsigned long n) {
+    // The file list is kept sorted by file number
+    int begin = 0;
+    int end = _fileList.size() - 1;
+
+    while (begin <= end) {
+        int mid = begin + (end - begin) / 2;
+        auto entry = &_fileList.at(mid);
+        if (n < entry->n) {
+            end = mid - 1;
+        } else if (n >= (entry->n + entry->files)) {
+            begin = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+
+    return -1;
+}
+
+void DiskQueue::scanFile(unsigned long n) {
+    auto entry = &_fileList.at(findFileNode(n));
+    char filename[FilenameMax];
+    formatFilename(filename, n);
+
+    auto fd = _storage->open(filename, O_RDWR);
+    if (0 > fd) {
+        return; // Left for the reader to discard
+    }
+
+    QueueFileHeader fileHeader = {};
+    if (!readFileHeader(fd, fileHeader, entry->length)) {
+        _storage->close(fd);
+        return; // Left for the reader to discard
+    }
+
+    _itemCount -= entry->count;
+    entry->count = 0;
+    entry->dead = 0;
+
+    size_t offset = fileHeaderSize(entry->length);
+    entry->head = offset;
+    while (offset < entry->size) {
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        if (((off_t)offset != _storage->seek(fd, offset)) ||
+            !readItemHeader(fd, entry->length, itemHeader, key)) {
+            break;
+        }
+
+        auto recordSize = itemRecordSize(itemHeader, entry->length);
+        if ((offset + recordSize) > entry->size) {
+            break;
+        }
+
+        if (ItemFlagActive & itemHeader.flags) {
+            entry->count++;
+            _itemCount++;
+            if (_coalescing && (ItemFlagKeyed & itemHeader.flags)) {
+                coalesceKey(key, n, offset);
+                // Removing a superseded file ahead of this one moves this entry
+                entry = &_fileList.at(findFileNode(n));
+            }
+        } else {
+            entry->dead += recordSize;
+            // Consumed items ahead of the first active one are behind the head
+            if (0 == entry->count) {
+                entry->head = offset + recordSize;
+            }
+        }
+        offset += recordSize;
+    }
+
+    // Drop a record torn by an interrupted append so that new items are not written after it
+    if (offset < entry->size) {
+        if (!_storage->truncate(fd, offset)) {
+            _diskCurrent -= entry->size - offset;
+            entry->size = offset;
+        } else {
+            entry->dead += entry->size - offset;
+        }
+    }
+
+    _storage->close(fd);
+}
+
+bool DiskQueue::clearActiveFlag(int fd, size_t offset, uint8_t flags, uint16_t length) {
+    // Only the flags byte is rewritten so the item framing stays intact
+    uint8_t cleared = flags & ~ItemFlagActive;
+    if (!length) {
+        offset += offsetof(QueueItemHeader, flags);
+    }
+
+    return ((off_t)offset == _storage->seek(fd, offset)) &&
+           ((int)sizeof(cleared) <= _storage->write(fd, &cleared, sizeof(cleared)));
+}
+
+void DiskQueue::tombstoneItem(unsigned long n, size_t offset) {
+    auto index = findFileNode(n);
+    if (0 > index) {
+        return;
+    }
+    auto entry = &_fileList.at(index);
+    char filename[FilenameMax];
+    formatFilename(filename, n);
+
+    auto fd = _storage->open(filename, O_RDWR);
+    if (0 > fd) {
+        return;
+    }
+
+    QueueItemHeader itemHeader = {};
+    uint32_t key = 0;
+    if (((off_t)offset != _storage->seek(fd, offset)) ||
+        !readItemHeader(fd, entry->length, itemHeader, key) ||
+        (0 == (ItemFlagActive & itemHeader.flags)) ||
+        !clearActiveFlag(fd, offset, itemHeader.flags, entry->length)) {
+        _storage->close(fd);
+        return;
+    }
+    _storage->sync(fd);
+    _storage->close(fd);
+
+    checkCompaction(n, offset);
+    removeReadAhead(n, offset);
+    entry->dead += itemRecordSize(itemHeader, entry->length);
+    entry->count--;
+    _itemCount--;
+
+    // Files without active items are reclaimed immediately, otherwise it is left to compaction
+    if (0 == entry->count) {
+        removeFileNode(index);
+        _storage->remove(filename);
+    }
+}
+
+void DiskQueue::coalesceKey(uint32_t key, unsigned long n, size_t offset) {
+    for (int i = 0; i < _keyIndex.size(); ++i) {
+        if (_keyIndex[i].key != key) {
+            continue;
+        }
+
+        unsigned long oldN = _keyIndex[i].n;
+        size_t oldOffset = _keyIndex[i].offset;
+        _keyIndex[i].n = n;
+        _keyIndex[i].offset = offset;
+
+        // Clearing the active flag on disk ensures the stale value is not recovered after a restart
+        tombstoneItem(oldN, oldOffset);
+        return;
+    }
+
+    _keyIndex.append({key, n, offset});
+}
+
+void DiskQueue::removeKey(unsigned long n, size_t offset) {
+    for (int i = 0; i < _keyIndex.size(); ++i) {
+        if ((_keyIndex[i].n == n) && (_keyIndex[i].offset == offset)) {
+            _keyIndex.removeAt(i);
+            return;
+        }
+    }
+}
+
+bool DiskQueue::selectCompaction(float deadRatio) {
+    // The newest segment is still being appended to so it is never compacted
+    int selected = -1;
+    float selectedRatio = 0.0f;
+    for (int i = 0; i < (_fileList.size() - 1); ++i) {
+        // Items consumed ahead of the head are reclaimed with the whole segment once the rest is
+        // read, so only the holes left among the remaining items count
+        auto entry = &_fileList.at(i);
+        size_t head = std::max<size_t>(entry->head, fileHeaderSize(entry->length));
+        size_t consumed = head - fileHeaderSize(entry->length);
+        if ((entry->dead <= consumed) || (head >= entry->size)) {
+            continue;
+        }
+        float ratio = (float)(entry->dead - consumed) / (float)(entry->size - head);
+        if ((ratio >= deadRatio) && (ratio > selectedRatio)) {
+            selected = i;
+            selectedRatio = ratio;
+        }
+    }
+
+    if (0 > selected) {
+        return false;
+    }
+
+    auto entry = &_fileList.at(selected);
+    _compaction.n = entry->n;
+    _compaction.offset = entry->head; // Everything before the head has been consumed
+    _compaction.size = 0;
+    _compaction.count = 0;
+    _compaction.active = true;
+
+    return true;
+}
+
+bool DiskQueue::compactStep(size_t budget) {
+    if (!_compaction.active && !selectCompaction(_compactionRatio)) {
+        return false;
+    }
+
+    auto index = findFileNode(_compaction.n);
+    if (0 > index) {
+        abortCompaction();
+        return false;
+    }
+    auto entry = &_fileList.at(index);
+
+    char filename[FilenameMax];
+    formatFilename(filename, entry->n);
+    char tempname[FilenameMax];
+    formatFilename(tempname, entry->n, TempSuffix);
+
+    auto src = _storage->open(filename, O_RDONLY);
+    if (0 > src) {
+        abortCompaction();
+        return false;
+    }
+
+    // The replacement file is created on the first step and appended to on the following ones
+    auto flags = (0 == _compaction.size) ? (O_CREAT | O_TRUNC | O_WRONLY | O_APPEND) : (O_WRONLY | O_APPEND);
+    auto dst = _storage->open(tempname, flags);
+    if (0 > dst) {
+        _storage->close(src);
+        abortCompaction();
+        return false;
+    }
+
+    auto success = true;
+    if (0 == _compaction.size) {
+        QueueFileHeader fileHeader = {};
+        QueueCompactHeader compactHeader = {};
+        if (!readFileHeader(src, fileHeader, compactHeader.length) ||
+            ((int)sizeof(fileHeader) > _storage->write(dst, &fileHeader, sizeof(fileHeader))) ||
+            (compactHeader.length &&
+             ((int)sizeof(compactHeader) > _storage->write(dst, &compactHeader, sizeof(compactHeader))))) {
+            success = false;
+        } else {
+            entry->length = compactHeader.length;
+            _compaction.size = fileHeaderSize(entry->length);
+            _compaction.offset = std::max<size_t>(_compaction.offset, _compaction.size);
+        }
+    }
+
+    size_t processed = 0;
+    while (success && (processed < budget) && (_compaction.offset < entry->size)) {
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        if (((off_t)_compaction.offset != _storage->seek(src, _compaction.offset)) ||
+            !readItemHeader(src, entry->length, itemHeader, key)) {
+            // Nothing past an unreadable record can be recovered
+            _compaction.offset = entry->size;
+            break;
+        }
+
+        auto recordSize = itemRecordSize(itemHeader, entry->length);
+        if (ItemFlagActive & itemHeader.flags) {
+            // Copy the whole record, header and key included, through a small stack buffer
+            uint8_t buffer[CompactionCopySize];
+            size_t copied = 0;
+            if ((off_t)_compaction.offset != _storage->seek(src, _compaction.offset)) {
+                success = false;
+                break;
+            }
+            while (copied < recordSize) {
+                auto chunk = std::min<size_t>(sizeof(buffer), recordSize - copied);
+                if (((int)chunk > _storage->read(src, buffer, chunk)) ||
+                    ((int)chunk > _storage->write(dst, buffer, chunk))) {
+                    success = false;
+                    break;
+                }
+                copied += chunk;
+            }
+            _compaction.size += copied;
+            _compaction.count++;
+        }
+
+        _compaction.offset += recordSize;
+        processed += recordSize;
+    }
+
+    _storage->close(src);
+    if (success && (_compaction.offset >= entry->size)) {
+        _storage->sync(dst);
+    }
+    _storage->close(dst);
+
+    if (!success) {
+        abortCompaction();
+        return false;
+    }
+
+    if (_compaction.offset >= entry->size) {
+        finishCompaction(index);
+        return false;
+    }
+
+    return true;
+}
+
+void DiskQueue::finishCompaction(int index) {
+    auto entry = &_fileList.at(index);
+    char filename[FilenameMax];
+    formatFilename(filename, entry->n);
+    char tempname[FilenameMax];
+    formatFilename(tempname, entry->n, TempSuffix);
+
+    _compaction.active = false;
+
+    if (0 == _compaction.count) {
+        _storage->remove(tempname);
+        _storage->remove(filename);
+        removeFileNode(index);
+        _stats.compactionRuns++;
+        return;
+    }
+
+    // Rename atomically replaces the segment so either the old or the new copy survives a reset
+    if (_storage->rename(tempname, filename)) {
+        _storage->remove(tempname);
+        _stats.compactionAborts++;
+        return;
+    }
+
+    // Items read ahead from the old copy no longer match their offsets
+    removeReadAheadFile(entry->n, true);
+
+    _stats.compactionRuns++;
+    _stats.compactionReclaimed += entry->size - _compaction.size;
+    _diskCurrent -= entry->size - _compaction.size;
+    _itemCount -= entry->count;
+    _itemCount += _compaction.count;
+    entry->size = _compaction.size;
+    entry->head = fileHeaderSize(entry->length);
+    entry->dead = 0;
+    entry->count = _compaction.count;
+
+    // Items moved so the key index has to follow them
+    if (_coalescing) {
+        auto fd = _storage->open(filename, O_RDONLY);
+        if (0 > fd) {
+            return;
+        }
+        size_t offset = entry->head;
+        while (offset < entry->size) {
+            QueueItemHeader itemHeader = {};
+            uint32_t key = 0;
+            if (((off_t)offset != _storage->seek(fd, offset)) ||
+                !readItemHeader(fd, entry->length, itemHeader, key)) {
+                break;
+            }
+            if (ItemFlagKeyed & itemHeader.flags) {
+                for (int i = 0; i < _keyIndex.size(); ++i) {
+                    if ((_keyIndex[i].key == key) && (_keyIndex[i].n == entry->n)) {
+                        _keyIndex[i].offset = offset;
+                        break;
+                    }
+                }
+            }
+            offset += itemRecordSize(itemHeader, entry->length);
+        }
+        _storage->close(fd);
+    }
+}
+
+void DiskQueue::abortCompaction() {
+    char tempname[FilenameMax];
+    formatFilename(tempname, _compaction.n, TempSuffix);
+    _storage->remove(tempname);
+
+    _compaction.active = false;
+    _stats.compactionAborts++;
+}
+
+void DiskQueue::checkCompaction(unsigned long n, size_t offset) {
+    // Items not yet copied are read with their current flags so only earlier ones matter
+    if (_compaction.active && (_compaction.n == n) && (offset < _compaction.offset)) {
+        abortCompaction();
+    }
+}
+
+DiskQueue::ReadAheadEntry* DiskQueue::getReadAheadFront(bool fill) {
+    if (_readAheadData.isEmpty()) {
+        return nullptr;
+    }
+
+    // Fall back to reading from disk if the buffer no longer starts at the front file
+    if (!_readAhead.isEmpty() &&
+        (_fileList.isEmpty() || (_readAhead.first().n != _fileList.first().n))) {
+        _readAhead.clear();
+    }
+
+    if (_readAhead.isEmpty() && fill) {
+        fillReadAhead();
+    }
+
+    return _readAhead.isEmpty() ? nullptr : &_readAhead.first();
+}
+
+bool DiskQueue::allocateReadAhead(size_t length, size_t& pos) {
+    size_t capacity = (size_t)_readAheadData.size();
+    if (_readAhead.isEmpty()) {
+        pos = 0;
+        return length <= capacity;
+    }
+
+    // Item data is kept contiguous and wraps around to the start of the buffer as a whole
+    size_t first = _readAhead.first().pos;
+    size_t end = _readAhead.last().pos + _readAhead.last().length;
+    if (end > first) {
+        if ((capacity - end) >= length) {
+            pos = end;
+            return true;
+        }
+        if (first >= length) {
+            pos = 0;
+            return true;
+        }
+        return false;
+    }
+
+    if ((first - end) >= length) {
+        pos = end;
+        return true;
+    }
+    return false;
+}
+
+size_t DiskQueue::fillReadAhead() {
+    if (_readAheadData.isEmpty() || _fileList.isEmpty()) {
+        return _readAhead.size();
+    }
+
+    int index = 0;
+    unsigned long fileN = 0;
+    uint16_t length = 0;
+    size_t offset = 0;
+    size_t position = 0;
+    int fd = -1;
+
+    if (_readAhead.isEmpty()) {
+        // Start at the front, letting the reader discard consumed items and unreadable files
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        fd = openFront(itemHeader, key);
+        if (0 > fd) {
+            return 0;
+        }
+        auto entry = &_fileList.first();
+        fileN = entry->n;
+        length = entry->length;
+        offset = entry->head;
+        position = offset + itemRecordSize(itemHeader, length) - itemHeader.length;
+    } else {
+        // Continue after the last item read ahead
+        fileN = _readAhead.last().n;
+        index = findFileNode(fileN);
+        offset = _readAhead.last().next;
+        if (0 > index) {
+            return _readAhead.size();
+        }
+    }
+
+    while (_readAhead.size() < (int)_readAheadItems) {
+        auto entry = &_fileList.at(index);
+        // Only the first file of a range has a head and a known record format
+        bool first = (fileN == entry->n);
+        size_t fileSize = entry->size / entry->files;
+
+        if (0 > fd) {
+            char filename[FilenameMax];
+            formatFilename(filename, fileN);
+            fd = _storage->open(filename, O_RDONLY);
+            QueueFileHeader fileHeader = {};
+            if ((0 > fd) || !readFileHeader(fd, fileHeader, length)) {
+                break; // Left for the reader to discard once it reaches this file
+            }
+            if (first) {
+                entry->length = length;
+            }
+            position = fileHeaderSize(length);
+            offset = std::max<size_t>(std::max<size_t>(offset, first ? entry->head : 0), position);
+        }
+
+        if (offset >= fileSize) {
+            _storage->close(fd);
+            fd = -1;
+            offset = 0;
+            if ((fileN + 1) < (entry->n + entry->files)) {
+                fileN++;
+            } else if (++index < _fileList.size()) {
+                fileN = _fileList.at(index).n;
+            } else {
+                break;
+            }
+            continue;
+        }
+
+        QueueItemHeader itemHeader = {};
+        uint32_t key = 0;
+        if ((position != offset) &&
+            ((off_t)offset != _storage->seek(fd, offset))) {
+            break;
+        }
+        if (!readItemHeader(fd, length, itemHeader, key)) {
+            break;
+        }
+        auto recordSize = itemRecordSize(itemHeader, length);
+        position = offset + recordSize - itemHeader.length;
+        if ((offset + recordSize) > fileSize) {
+            break;
+        }
+
+        if (ItemFlagActive & itemHeader.flags) {
+            size_t pos = 0;
+            if (!allocateReadAhead(itemHeader.length, pos) ||
+                ((int)itemHeader.length > _storage->read(fd, _readAheadData.data() + pos, itemHeader.length))) {
+                break;
+            }
+            position += itemHeader.length;
+            _readAhead.append({fileN, offset, offset + recordSize, pos, itemHeader.length, itemHeader.flags});
+        }
+        offset += recordSize;
+    }
+
+    if (0 <= fd) {
+        _storage->close(fd);
+    }
+
+    return _readAhead.size();
+}
+
+void DiskQueue::removeReadAhead(unsigned long n, size_t offset) {
+    for (int i = 0; i < _readAhead.size(); ++i) {
+        if ((_readAhead[i].n == n) && (_readAhead[i].offset == offset)) {
+            _readAhead.removeAt(i);
+            return;
+        }
+    }
+}
+
+void DiskQueue::removeReadAheadFile(unsigned long n, bool following) {
+    for (int i = 0; i < _readAhead.size();) {
+        if (_readAhead[i].n == n) {
+            // Later items stay valid unless they must follow the removed ones in queue order
+            _readAhead.removeAt(i, following ? (_readAhead.size() - i) : 1);
+        } else {
+            ++i;
+        }
+    }
+}
+
+int DiskQueue::getFilenames(const char* path) {
+    DISKQUEUE_TRACE_SCOPE("getFilenames");
+
+    DISKQUEUE_TRACE_PHASE("readdir");
+    _segmentMarker = false;
+    auto ret = _storage->listDirectory(path, [](const char* name, size_t size, void* context) -> int {
+        auto queue = static_cast<DiskQueue*>(context);
         char* stop = nullptr;
-        unsigned long n = strtoul(ent->d_name, &stop, 10);
-        if (strlen(ent->d_name) == (size_t)(stop - ent->d_name)) {
-            FileEntry* entry = addFileNode(n, st.st_size);
-            CHECK_TRUE(entry, SYSTEM_ERROR_NO_MEMORY);
+        unsigned long n = strtoul(name, &stop, 10);
+        size_t length = strlen(name);
+        if (length == (size_t)(stop - name)) {
+            // Files listed in order extend the last range right away, others are merged once sorted
+            if (queue->fileRanges()) {
+                CHECK_TRUE(queue->appendFileNode(n, size), SYSTEM_ERROR_NO_MEMORY);
+            } else {
+                CHECK_TRUE(queue->addFileNode(n, size), SYSTEM_ERROR_NO_MEMORY);
+            }
+        } else if (!strcmp(name, SegmentMarker)) {
+            queue->_segmentMarker = true;
+        } else if (!strcmp(stop, TempSuffix)) {
+            // Leftover from an interrupted compaction, the original segment is still intact
+            queue->_storage->remove(queue->_path + name);
         }
+        return SYSTEM_ERROR_NONE;
+    }, this);
+    if (0 > ret) {
+        return (-1 == ret) ? SYSTEM_ERROR_NOT_FOUND : ret;
     }
 
+    DISKQUEUE_TRACE_PHASE("sort");
     quickSortFiles(_fileList, 0, _fileList.size() - 1);
-
-    closedir(dir);
+    if (fileRanges()) {
+        mergeFileNodes();
+    }
 
     return SYSTEM_ERROR_NONE;
 }
-
@@ -17,15 +17,36 @@
 #pragma once
 
 #include "Particle.h"
+#include <condition_variable>
+
+#include "DiskQueueStorage.h"
 
 /**
  * @brief Structure for holding status and diagnostics information
  */
 struct DiskQueueStats {
-    size_t filesTotal;
-
+    size_t filesTotal;              //< Number of queue files on disk
+    size_t itemsTotal;              //< Number of active items in the queue
+    size_t deadBytes;               //< Bytes held by consumed or tombstoned items that have not been reclaimed
+    size_t compactionRuns;          //< Number of segments rewritten by compaction
+    size_t compactionAborts;        //< Number of compactions abandoned because their segment changed
+    size_t compactionReclaimed;     //< Total bytes reclaimed by compaction
+    bool compactionActive;          //< A segment is currently being compacted
+    size_t readAheadItems;          //< Number of items held in the read-ahead buffer
+    size_t indexEntries;            //< Number of entries in the in-RAM file list
+    size_t indexBytes;              //< RAM allocated by the file list and key index
 };
 
+/**
+ * @brief Called with each block of an exported stream.
+ *
+ * @param[in]   data            Exported bytes
+ * @param[in]   size            Number of exported bytes
+ * @param[in]   context         Context pointer given to the export
+ * @return int SYSTEM_ERROR_NONE to continue, otherwise the export stops and this error is returned
+ */
+typedef int (*DiskQueueExportCallback)(const uint8_t* data, size_t size, void* context);
+
 enum class DiskQueuePolicy {
     FifoDeleteOld,
     FifoDeleteNew,
@@ -47,7 +68,22 @@ public:
     DiskQueue(size_t diskLimit = 0)
     : _diskLimit(diskLimit),
       _diskCurrent(0),
+      _segmentSize(0),
+      _recordSize(0),
+      _fileCapacity(0),
+      _keyCapacity(0),
+      _readAheadItems(0),
+      _readAheadBytes(0),
+      _itemCount(0),
+      _fileCount(0),
+      _compactionRatio(0.0f),
+      _compactionStep(CompactionStepDefault),
+      _stats(),
+      _compaction(),
+      _storage(&DiskQueuePosixStorage::instance()),
       _policy(DiskQueuePolicy::FifoDeleteOld),
+      _coalescing(false),
+      _segmentMarker(false),
       _running(false) {
 
     }
@@ -69,6 +105,7 @@ public:
      * @param[in]   path            Full directory path for storing the queue on the file system, eg `/usr/my_queue`
      * @param[in]   policy          Queue policy
      * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
      * @retval SYSTEM_ERROR_NO_MEMORY
      * @retval SYSTEM_ERROR_FILE
      */
@@ -83,6 +120,7 @@ public:
      * @param[in]   diskLimit       Total disk space reserved for queue
      * @param[in]   policy          Queue policy
      * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_ARGUMENT
      * @retval SYSTEM_ERROR_NO_MEMORY
      * @retval SYSTEM_ERROR_FILE
      */
@@ -100,7 +138,8 @@ public:
     int stop();
 
     /**
-     * @brief Set the disk limit.
+     * @brief Set the disk limit.  Once a new item would take the queue beyond it, FifoDeleteOld
+     * drops the oldest files to make room while FifoDeleteNew refuses the new item.
      *
      * @param size Size in bytes.
      */
@@ -125,7 +164,158 @@ public:
     }
 
     /**
-     * @brief Remove front item from read queue if available.
+     * @brief Set a fixed capacity for the in-RAM indexes.  The file list and key index are
+     * preallocated by start() and never grow afterwards, so pushing, peeking and popping do not
+     * allocate memory.  Once the file list is full, FifoDeleteOld drops the oldest file to make
+     * room for a new item while FifoDeleteNew refuses the new item, as the disk limit drops it.
+     * Once the key index is full items with new keys are refused.
+     *
+     * @param[in]   files           Maximum number of queue files, zero for no limit
+     * @param[in]   keys            Maximum number of coalescing keys, zero for no limit
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     */
+    int setCapacity(size_t files, size_t keys = 0);
+
+    /**
+     * @brief Configure read-ahead of the front items into RAM.  The buffer is allocated by start().
+     * When the buffer is empty, peekFront() and peekFrontSize() fill it with up to the given number
+     * of items in a single pass, so following peeks are served from RAM.  readAhead() may also be
+     * called from another thread, for example while the consumer waits for the network.
+     *
+     * @param[in]   items           Maximum number of items held, zero to disable read-ahead
+     * @param[in]   bytes           Size of the buffer holding item data
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     */
+    int setReadAhead(size_t items, size_t bytes);
+
+    /**
+     * @brief Read items following those already in the read-ahead buffer until it is full.
+     *
+     * @return size_t Number of items held in the read-ahead buffer
+     */
+    size_t readAhead();
+
+    /**
+     * @brief Set the segment size.  When non-zero, items are appended to the newest queue file
+     * until it would grow beyond this size instead of each item being written to its own file.
+     * Popped and tombstoned items are then marked inactive in place and their space is recovered
+     * once the whole file is consumed or by compaction.  A segment grows to at most half the disk
+     * limit, as making room for new items drops the oldest segment whole.  Starting a queue with
+     * segments marks its directory, so that a queue later started there with a segment size of
+     * zero opens every file once in start() to find those holding more than one item.  The mark
+     * is removed once none are left, after which start() no longer opens the files.
+     *
+     * Without segments the index needs an entry per file wherever neighbouring items differ in
+     * size, so its RAM grows with the backlog.  Use segments to bound it when item sizes vary.
+     *
+     * @param[in]   size            Segment size in bytes, zero for one item per file
+     */
+    void setSegmentSize(size_t size);
+
+    /**
+     * @brief Get the segment size in bytes.
+     *
+     * @return size_t Size in bytes.
+     */
+    size_t getSegmentSize() const {
+        return _segmentSize;
+    }
+
+    /**
+     * @brief Set the compact record size.  Items of exactly this size are written as compact
+     * records, leaving only a flags byte (and key if present) in front of the data, to files that
+     * store the record length once in their header.  Items of any other size are written with a
+     * full item header to separate files.
+     *
+     * @param[in]   size            Record size in bytes, zero to disable compact records
+     */
+    void setRecordSize(size_t size);
+
+    /**
+     * @brief Get the compact record size in bytes.
+     *
+     * @return size_t Size in bytes.
+     */
+    size_t getRecordSize() const {
+        return _recordSize;
+    }
+
+    /**
+     * @brief Configure automatic compaction.  After each push and pop, a bounded compaction step
+     * is run if any segment other than the newest has a dead-space ratio at or above the given
+     * ratio.  Live items of that segment are copied to a temporary file which atomically replaces
+     * the segment once complete.  Only holes left by tombstoned items among those still queued
+     * count as dead space, as items popped from the front are reclaimed with the whole segment.
+     *
+     * @param[in]   deadRatio       Ratio of dead bytes to item bytes after the first queued item of a segment that triggers compaction, zero to disable
+     * @param[in]   stepSize        Maximum number of source bytes processed in each step
+     */
+    void setCompaction(float deadRatio, size_t stepSize = CompactionStepDefault);
+
+    /**
+     * @brief Run one compaction step regardless of automatic compaction settings.  A segment is
+     * only selected if it has dead space and meets the configured dead-space ratio, or any dead
+     * space when automatic compaction is disabled.
+     *
+     * @param[in]   budget          Maximum number of source bytes to process
+     * @return true Compaction work remains in progress
+     * @return false No compaction is in progress
+     */
+    bool compact(size_t budget = CompactionStepDefault);
+
+    /**
+     * @brief Get status and diagnostics information.
+     *
+     * @return DiskQueueStats Current statistics
+     */
+    DiskQueueStats getStats();
+
+    /**
+     * @brief Set the storage holding the queue files.  The storage is not owned by the queue and
+     * must outlive it.  By default files are kept on the device file system.
+     *
+     * @param[in]   storage         Storage for queue files, nullptr for the device file system
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     */
+    int setStorage(DiskQueueStorage* storage);
+
+    /**
+     * @brief Get the storage holding the queue files.
+     *
+     * @return DiskQueueStorage* Storage for queue files
+     */
+    DiskQueueStorage* getStorage() const {
+        return _storage;
+    }
+
+    /**
+     * @brief Enable or disable key-based coalescing (latest-value-wins).  When enabled, an in-RAM
+     * index of keys to queue files is kept and pushing a keyed item tombstones any older item queued
+     * with the same key so that the backlog is bounded by the number of distinct keys.  The index is
+     * rebuilt from disk by start() so this must be set before the queue is started.
+     *
+     * @param[in]   enable          True to enable coalescing
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_INVALID_STATE
+     */
+    int setCoalescing(bool enable);
+
+    /**
+     * @brief Indicate whether key-based coalescing is enabled.
+     *
+     * @return true Coalescing is enabled
+     * @return false Coalescing is disabled
+     */
+    bool getCoalescing() const {
+        return _coalescing;
+    }
+
+    /**
+     * @brief Remove front item from read queue if available.  An item whose removal cannot be
+     * recorded on disk stays at the front, so size() is unchanged.
      */
     void popFront(); //TODO: should this method signature be similar to peek_front ?
 
@@ -139,6 +329,27 @@ public:
      */
     bool peekFront(uint8_t* data, size_t& size);
 
+    /**
+     * @brief Inspect item from read queue, waiting until one is pushed if the queue is empty.
+     *
+     * @param[out]     data     Buffer to copy the data into
+     * @param[in,out]  size     [in] maximum buffer size available for copying data into, [out] size written
+     * @param[in]      timeout  Maximum time to wait in milliseconds
+     * @return true Item has been taken and is in output object
+     * @return false No item became available before the timeout expired or the queue was stopped
+     */
+    bool peekFront(uint8_t* data, size_t& size, system_tick_t timeout);
+
+    /**
+     * @brief Wait until the read queue is not empty.  The calling thread sleeps without polling
+     * the file system and is woken as soon as an item is pushed.
+     *
+     * @param[in]      timeout  Maximum time to wait in milliseconds
+     * @return true An item is available
+     * @return false No item became available before the timeout expired or the queue was stopped
+     */
+    bool waitFront(system_tick_t timeout);
+
     /**
      * @brief Get size of data from read queue if available.
      *
@@ -174,6 +385,86 @@ public:
      */
     bool pushBack(const String& data);
 
+    /**
+     * @brief Push keyed item to write queue if space available.  When coalescing is enabled any
+     * older item with the same key is tombstoned and its disk space reclaimed.
+     *
+     * @param[in]      data     Where to copy data from
+     * @param[in]      size     size of the input data
+     * @param[in]      key      Coalescing key for the item
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushBackKeyed(const uint8_t* data, size_t size, uint32_t key);
+
+    /**
+     * @brief Push keyed null terminated character string item to write queue if space available
+     *
+     * @param[in]      data     Where to copy string data from
+     * @param[in]      key      Coalescing key for the item
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushBackKeyed(const char* data, uint32_t key);
+
+    /**
+     * @brief Push keyed String item to write queue if space available
+     *
+     * @param[in]      data     Where to copy data from
+     * @param[in]      key      Coalescing key for the item
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushBackKeyed(const String& data, uint32_t key);
+
+    /**
+     * @brief Export items to a file descriptor in one operation without removing them.  Each item
+     * is written with its framing: a 4-byte item header (magic 0xf0, flags, little-endian 16-bit
+     * length), the 32-bit key if the keyed flag (0x02) is set, then the item data.  On Linux the
+     * item data is copied from the queue files with copy_file_range() or sendfile().
+     *
+     * @param[in]   fd              File descriptor to write to
+     * @param[in]   first           Position of the first item to export, zero for the front item
+     * @param[in]   count           Maximum number of items to export
+     * @return int Number of items exported, or a negative error
+     */
+    int exportItems(int fd, size_t first = 0, size_t count = SIZE_MAX);
+
+    /**
+     * @brief Export items to a callback in one operation without removing them.  The callback
+     * receives the same stream as exportItems() with a file descriptor, in blocks of any size.
+     *
+     * @param[in]   callback        Callback receiving the exported stream
+     * @param[in]   context         Context pointer passed to the callback
+     * @param[in]   first           Position of the first item to export, zero for the front item
+     * @param[in]   count           Maximum number of items to export
+     * @return int Number of items exported, or a negative error
+     */
+    int exportItems(DiskQueueExportCallback callback, void* context, size_t first = 0, size_t count = SIZE_MAX);
+
+    /**
+     * @brief Export items from the front of the queue to a file descriptor and remove them as one
+     * step.  No other push or pop can run in between and items are only removed if every one of
+     * them was exported and the descriptor was synced.  Items exported before a reset that
+     * interrupts the removal are exported again.  Files ahead of the last item exported that
+     * could not be read are removed with the exported items.
+     *
+     * @param[in]   fd              File descriptor to write to
+     * @param[in]   count           Maximum number of items to export
+     * @return int Number of items exported and removed, or a negative error
+     */
+    int drainItems(int fd, size_t count = SIZE_MAX);
+
+    /**
+     * @brief Export items from the front of the queue to a callback and remove them as one step.
+     *
+     * @param[in]   callback        Callback receiving the exported stream
+     * @param[in]   context         Context pointer passed to the callback
+     * @param[in]   count           Maximum number of items to export
+     * @return int Number of items exported and removed, or a negative error
+     */
+    int drainItems(DiskQueueExportCallback callback, void* context, size_t count = SIZE_MAX);
+
     /**
      * @brief Indicate whether the queue is empty.
      *
@@ -185,12 +476,12 @@ public:
     }
 
     /**
-     * @brief Get the size of elements on disk in bytes.
+     * @brief Get the number of items in the queue.
      *
-     * @return size_t Number of bytes on disk
+     * @return size_t Number of active items
      */
     size_t size() const {
-        return (size_t)_fileList.size();
+        return _itemCount;
     }
 
     /**
@@ -221,10 +512,22 @@ public:
 private:
     static constexpr uint8_t QueueFileMagic = 'P';          //< Magic number that must be present at the beginning of each queue file
     static constexpr uint8_t QueueFileVersion1 = 0x01;      //< Current version of the file
+    static constexpr uint8_t QueueFileVersion2 = 0x02;      //< Version of files holding compact records
     static constexpr uint8_t FileFlagReverse = (1 << 0);    //< Flag to indicate that the queue is to be popped in reverse order
+    static constexpr uint8_t FileFlagCompact = (1 << 1);    //< Flag to indicate that items are compact records of a fixed length
 
     static constexpr uint8_t QueueItemMagic = 0xf0;         //< Magic number that must be present at the beginning of each queue item
     static constexpr uint8_t ItemFlagActive = (1 << 0);     //< Flag to indicate that the queue item is still active
+    static constexpr uint8_t ItemFlagKeyed = (1 << 1);      //< Flag to indicate that a 32-bit coalescing key follows the item header
+
+    static constexpr size_t FilenameMax = 80;               //< Size of the buffers holding full queue file paths
+    static constexpr size_t FilenameSuffixMax = 16;         //< Room for the separator, file number, suffix and terminator
+    static constexpr const char* TempSuffix = ".tmp";       //< Suffix of files being written by compaction
+    static constexpr const char* SegmentMarker = "segment"; //< File marking a directory that may hold segment files
+
+    static constexpr size_t CompactionStepDefault = 512;    //< Default number of bytes processed by each compaction step
+    static constexpr size_t CompactionCopySize = 64;        //< Size of the stack buffer used to copy items during compaction
+    static constexpr size_t ExportCopySize = 64;            //< Size of the stack buffer used to export items to a callback
 
 #pragma pack(push,1)
     struct QueueFileHeader {
@@ -237,26 +540,132 @@ private:
         uint8_t flags;          //< Various item specific flags
         uint16_t length;        //< Length of data immediately following this structure
     };
+    struct QueueCompactHeader {
+        uint16_t length;        //< Length of data of every item in a file with FileFlagCompact
+    };
 #pragma pack(pop)
 
     /**
-     * @brief A structure containing the disk based file numbers and filenames.
+     * @brief A structure containing the disk based file numbers and filenames.  Without segments
+     * or coalescing every file holds a single item, so one entry stands for a range of consecutive
+     * files of the same size.  The head and length then apply to the first file of the range.
+     * Files of a range are popped and removed without being opened, so their size has to follow
+     * from the entry.  Items of varying sizes therefore take an entry each, and segments are the
+     * only way to bound the RAM used by a backlog of such items.
      *
      */
     struct FileEntry {
+        unsigned long n;        //< File number, also filename, of the first file
+        size_t size;            //< Size of the files on disk
+        size_t head;            //< Offset of the next item to be read
+        size_t dead;            //< Bytes held by consumed or tombstoned items
+        unsigned count;         //< Number of active items in the files
+        uint16_t length;        //< Data length of compact records, zero if items carry a full header
+        uint16_t files;         //< Number of consecutive files, each of size / files bytes
+    };
+
+    /**
+     * @brief A structure mapping a coalescing key to the location of its latest item.
+     *
+     */
+    struct KeyEntry {
+        uint32_t key;
         unsigned long n;
-        int fd;
-        size_t size;
+        size_t offset;
+    };
+
+    /**
+     * @brief An item held in the read-ahead buffer.
+     *
+     */
+    struct ReadAheadEntry {
+        unsigned long n;        //< File number holding the item
+        size_t offset;          //< Offset of the item record in the file
+        size_t next;            //< Offset of the following record in the file
+        size_t pos;             //< Position of the item data in the read-ahead buffer
+        uint16_t length;        //< Length of the item data
+        uint8_t flags;          //< Item flags when read
+    };
+
+    /**
+     * @brief State of an incremental segment compaction.
+     *
+     */
+    struct CompactionJob {
+        unsigned long n;        //< File number of the segment being compacted
+        size_t offset;          //< Offset of the next source item to copy
+        size_t size;            //< Bytes written to the replacement file
+        unsigned count;         //< Active items copied to the replacement file
+        bool active;            //< Compaction is in progress
+    };
+
+    /**
+     * @brief State of an export.
+     *
+     */
+    struct ExportJob {
+        int fd;                             //< File descriptor written to, -1 when exporting to a callback
+        DiskQueueExportCallback callback;   //< Callback receiving the exported stream
+        void* context;                      //< Context pointer passed to the callback
+        size_t first;                       //< Position of the first item to export
+        size_t count;                       //< Maximum number of items to export
+        size_t position;                    //< Position of the next active item
+        size_t exported;                    //< Number of items exported
+        unsigned long lastN;                //< File number of the last item exported
+        size_t lastEnd;                     //< Offset following the last item exported
     };
 
     /**
-     * @brief Detect if path exists.
+     * @brief Get the read-ahead entry of the front item.  Entries are discarded if they no longer
+     * start at the front file.
+     *
+     * @param[in]   fill            Fill the read-ahead buffer if it is empty
+     * @return ReadAheadEntry* Front entry.  nullptr if none is available.
+     */
+    ReadAheadEntry* getReadAheadFront(bool fill);
+
+    /**
+     * @brief Find room for item data in the read-ahead buffer.
+     *
+     * @param[in]   length          Length of the item data
+     * @param[out]  pos             Position of the room in the buffer
+     * @return true Room has been found
+     * @return false The buffer is full
+     */
+    bool allocateReadAhead(size_t length, size_t& pos);
+
+    /**
+     * @brief Read active items following the last read-ahead entry, or from the front if there
+     * are none, until the buffer is full.
+     *
+     * @return size_t Number of items held in the read-ahead buffer
+     */
+    size_t fillReadAhead();
+
+    /**
+     * @brief Remove the read-ahead entry of the item at the given location, if any.
+     *
+     * @param[in]   n               File number
+     * @param[in]   offset          Offset of the item header
+     */
+    void removeReadAhead(unsigned long n, size_t offset);
+
+    /**
+     * @brief Remove the read-ahead entries of the given file.
      *
-     * @param[in]   path            Full path of file or directory
-     * @return true File or directory exists
-     * @return false File or directory doesn't exist
+     * @param[in]   n               File number
+     * @param[in]   following       Also remove all entries after the first one of this file
      */
-    bool dirExists(const char* path);
+    void removeReadAheadFile(unsigned long n, bool following);
+
+    /**
+     * @brief Format the full path of a queue file into a buffer of FilenameMax bytes.
+     *
+     * @param[out]  filename        Buffer receiving the path
+     * @param[in]   n               File number
+     * @param[in]   suffix          Suffix appended to the file number
+     */
+    void formatFilename(char* filename, unsigned long n, const char* suffix = "");
 
     /**
      * @brief Quicksort partition for file numbers.
@@ -266,7 +675,7 @@ private:
      * @param[in]       end         Last index to consider (inclusive)
      * @return int The pivot of the partition.
      */
-    int sortPartition(Vector<FileEntry*>& array, int begin, int end);
+    int sortPartition(Vector<FileEntry>& array, int begin, int end);
 
     /**
      * @brief Quicksort algorithm for file numbers.
@@ -275,25 +684,48 @@ private:
      * @param[in]       begin       First index to consider (inclusive)
      * @param[in]       end         Last index to consider (inclusive)
      */
-    void quickSortFiles(Vector<FileEntry*>& array, int begin, int end);
+    void quickSortFiles(Vector<FileEntry>& array, int begin, int end);
+
+    /**
+     * @brief Append a FileEntry initialized with the given file number and size to the file list.
+     *
+     * @param[in]   n               File number, also filename
+     * @param[in]   size            File size.
+     * @return FileEntry* Pointer to the entry in the file list, valid until the list is modified.  nullptr if unsuccessful.
+     */
+    FileEntry* addFileNode(unsigned long n, size_t size);
 
     /**
-     * @brief Create (allocate) FileEntry object and initialize it with given
-     * file number and file name.  Optionally append it to file list.
+     * @brief Append a file to the file list, extending the last range when the file directly
+     * follows it with the same size.  Only used when every file holds a single item.
      *
      * @param[in]   n               File number, also filename
      * @param[in]   size            File size.
-     * @param[in]   append          Append to end of file list.  True to append.  False to not append.
-     * @return FileEntry* Allocated FileEntry object pointer.  nullptr if unsuccessful.
+     * @return true File was added
+     * @return false Out of memory
      */
-    FileEntry* addFileNode(unsigned long n, size_t size, bool append = true);
+    bool appendFileNode(unsigned long n, size_t size);
 
     /**
-     * @brief Destroy FileEntry object.
+     * @brief Merge neighbouring ranges of the sorted file list that hold files of the same size.
      *
-     * @param[in]   entry           FileEntry object to delete.
      */
-    void removeFileNode(FileEntry* entry);
+    void mergeFileNodes();
+
+    /**
+     * @brief Whether a file directly follows a range and has the size of its files.
+     *
+     * @param[in]   entry           Entry holding the range
+     * @param[in]   n               File number
+     * @param[in]   size            File size
+     * @return true The file may be added to the range
+     * @return false The file needs an entry of its own
+     */
+    static bool joinsRange(const FileEntry& entry, unsigned long n, size_t size) {
+        return ((entry.n + entry.files) == n) &&
+               (UINT16_MAX > entry.files) &&
+               (entry.size == (entry.files * size));
+    }
 
     /**
      * @brief Remove and destroy FileEntry object from file list.
@@ -302,6 +734,253 @@ private:
      */
     void removeFileNode(int index);
 
+    /**
+     * @brief Remove a single file from disk and from the file list.  Entries holding one file are
+     * removed and ranges are shortened.
+     *
+     * @param[in]   index           Index into the file list.
+     * @param[in]   newest          Remove the last file of a range instead of the first
+     */
+    void removeFile(int index, bool newest);
+
+    /**
+     * @brief Whether the file list may hold ranges of single-item files.
+     *
+     */
+    bool fileRanges() const {
+        return (0 == _segmentSize) && !_coalescing;
+    }
+
+    /**
+     * @brief Size of a queue file header on disk.
+     *
+     * @param[in]   length          Data length of compact records, zero if items carry a full header
+     * @return size_t Size in bytes.
+     */
+    static size_t fileHeaderSize(uint16_t length) {
+        return sizeof(QueueFileHeader) + (length ? sizeof(QueueCompactHeader) : 0);
+    }
+
+    /**
+     * @brief Size of an item record on disk including its header and key.
+     *
+     * @param[in]   header          Item header
+     * @param[in]   length          Data length of compact records, zero if items carry a full header
+     * @return size_t Size in bytes.
+     */
+    static size_t itemRecordSize(const QueueItemHeader& header, uint16_t length) {
+        return (length ? sizeof(header.flags) : sizeof(header)) +
+               ((ItemFlagKeyed & header.flags) ? sizeof(uint32_t) : 0) +
+               header.length;
+    }
+
+    /**
+     * @brief Read and validate a queue file header from the current file position.
+     *
+     * @param[in]   fd              Open file descriptor
+     * @param[out]  header          File header
+     * @param[out]  length          Data length of compact records, zero if items carry a full header
+     * @return true Header is valid
+     * @return false Header could not be read or is invalid
+     */
+    bool readFileHeader(int fd, QueueFileHeader& header, uint16_t& length);
+
+    /**
+     * @brief Read and validate an item header, and its key if present, from the current file position.
+     * Compact records are returned as an equivalent full item header.
+     *
+     * @param[in]   fd              Open file descriptor
+     * @param[in]   length          Data length of compact records, zero if items carry a full header
+     * @param[out]  header          Item header
+     * @param[out]  key             Coalescing key, zero if the item is not keyed
+     * @return true Header is valid
+     * @return false Header could not be read or is invalid
+     */
+    bool readItemHeader(int fd, uint16_t length, QueueItemHeader& header, uint32_t& key);
+
+    /**
+     * @brief Open the file holding the front item and position it at the item data.  Consumed
+     * and tombstoned items are skipped and unreadable or exhausted files are removed.
+     *
+     * @param[out]  header          Item header of the front item
+     * @param[out]  key             Coalescing key of the front item, zero if not keyed
+     * @return int File descriptor.  Negative if the queue is empty.
+     */
+    int openFront(QueueItemHeader& header, uint32_t& key);
+
+    /**
+     * @brief Recover item counts, dead space and keys of a file from its item headers.  A torn
+     * record at the end of the file is truncated.
+     *
+     * @param[in]   n               File number of the file to scan
+     */
+    void scanFile(unsigned long n);
+
+    /**
+     * @brief Check that every file of an entry holds a single active item, as assumed when
+     * listed.  Other files, such as segments written with a different configuration, are split
+     * off the range and scanned.
+     *
+     * @param[in]   index           Index into the file list
+     * @param[out]  segments        Set if a file still holding active items was split off
+     * @return int Index of the next entry to check
+     */
+    int checkFileNode(int index, bool& segments);
+
+    /**
+     * @brief Check whether a file consists of exactly one active item record.  Unreadable files
+     * are left for the reader to discard and reported as a single item.
+     *
+     * @param[in]   n               File number
+     * @param[in]   size            File size
+     * @return true File holds a single item or cannot be read
+     * @return false File holds other records and must be scanned
+     */
+    bool holdsSingleItem(unsigned long n, size_t size);
+
+    /**
+     * @brief Find the file list index of the entry holding the given file number.
+     *
+     * @param[in]   n               File number to search for
+     * @return int Index into the file list.  -1 if not found.
+     */
+    int findFileNode(unsigned long n);
+
+    /**
+     * @brief Write an item to a new queue file and append it to the file list.
+     *
+     * @param[in]   data            Where to copy data from
+     * @param[in]   size            Size of the input data
+     * @param[in]   keyed           True if the item carries a coalescing key
+     * @param[in]   key             Coalescing key for the item
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushItem(const uint8_t* data, size_t size, bool keyed, uint32_t key);
+
+    /**
+     * @brief Mark the item at the given offset of an open file as no longer active by clearing ItemFlagActive.
+     *
+     * @param[in]   fd              Open file descriptor
+     * @param[in]   offset          Offset of the item header
+     * @param[in]   flags           Current item flags
+     * @param[in]   length          Data length of compact records, zero if items carry a full header
+     * @return true Item has been tombstoned
+     * @return false Item could not be tombstoned
+     */
+    bool clearActiveFlag(int fd, size_t offset, uint8_t flags, uint16_t length);
+
+    /**
+     * @brief Mark the item at the given location as no longer active and account for its dead space.
+     * The file is removed once it holds no more active items.
+     *
+     * @param[in]   n               File number
+     * @param[in]   offset          Offset of the item header
+     */
+    void tombstoneItem(unsigned long n, size_t offset);
+
+    /**
+     * @brief Record the latest location for a key.  Any older item with the same key is tombstoned.
+     *
+     * @param[in]   key             Coalescing key
+     * @param[in]   n               File number of the newest item with this key
+     * @param[in]   offset          Offset of the newest item with this key
+     */
+    void coalesceKey(uint32_t key, unsigned long n, size_t offset);
+
+    /**
+     * @brief Remove the key index entry pointing at the given location, if any.
+     *
+     * @param[in]   n               File number
+     * @param[in]   offset          Offset of the item header
+     */
+    void removeKey(unsigned long n, size_t offset);
+
+    /**
+     * @brief Export the selected items and optionally remove them from the front of the queue.
+     *
+     * @param[in]   job             Export target and range
+     * @param[in]   drain           Remove the queue up to the last item exported once all of them
+     *                              are exported
+     * @return int Number of items exported, or a negative error
+     */
+    int exportRange(ExportJob& job, bool drain);
+
+    /**
+     * @brief Export the selected items of a file.  Item data is transferred from the file while
+     * the framing is written from the item header read.
+     *
+     * @param[in]   job             Export target and range
+     * @param[in]   n               File number
+     * @param[in]   head            Offset of the first item that may be active
+     * @param[in]   size            Size of the file
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_IO
+     */
+    int exportFile(ExportJob& job, unsigned long n, size_t head, size_t size);
+
+    /**
+     * @brief Copy bytes of an open queue file to the export target.
+     *
+     * @param[in]   job             Export target
+     * @param[in]   fd              Open queue file descriptor
+     * @param[in]   offset          Offset of the first byte to copy
+     * @param[in]   size            Number of bytes to copy
+     * @retval SYSTEM_ERROR_NONE
+     * @retval SYSTEM_ERROR_IO
+     */
+    int exportTransfer(ExportJob& job, int fd, size_t offset, size_t size);
+
+    /**
+     * @brief Mark the active items at the head of a file that start before the given offset as
+     * consumed.  The file is removed once it holds no more active items.
+     *
+     * @param[in]   index           Index of the file in the file list
+     * @param[in]   end             Offset following the last item to consume
+     */
+    void consumeItems(int index, size_t end);
+
+    /**
+     * @brief Pick the segment with the most dead space that meets the given ratio.
+     *
+     * @param[in]   deadRatio       Minimum ratio of dead bytes, zero for any segment with dead space
+     * @return true A compaction has been started
+     * @return false No segment needs compaction
+     */
+    bool selectCompaction(float deadRatio);
+
+    /**
+     * @brief Copy up to the given number of source bytes of the current compaction and finish it
+     * once the whole segment has been copied.
+     *
+     * @param[in]   budget          Maximum number of source bytes to process
+     * @return true Compaction work remains in progress
+     * @return false No compaction is in progress
+     */
+    bool compactStep(size_t budget);
+
+    /**
+     * @brief Atomically replace the compacted segment with its rewritten copy and update the
+     * file list and key index.
+     *
+     * @param[in]   index           Index of the segment in the file list
+     */
+    void finishCompaction(int index);
+
+    /**
+     * @brief Abandon the current compaction and remove its temporary file.
+     *
+     */
+    void abortCompaction();
+
+    /**
+     * @brief Abandon the current compaction if it has already copied the item at the given location.
+     *
+     * @param[in]   n               File number
+     * @param[in]   offset          Offset of the item header
+     */
+    void checkCompaction(unsigned long n, size_t offset);
+
     enum class ItemState {
         InvalidMagic,
         Active,
@@ -335,10 +1014,29 @@ private:
     int getWriteOverflowPolicyIndex(DiskQueuePolicy policy);
 
     RecursiveMutex _lock;
-    Vector<FileEntry*> _fileList;
+    std::condition_variable_any _available;
+    Vector<FileEntry> _fileList;
+    Vector<KeyEntry> _keyIndex;
+    Vector<ReadAheadEntry> _readAhead;
+    Vector<uint8_t> _readAheadData;
     size_t _diskLimit;
     size_t _diskCurrent;
+    size_t _segmentSize;
+    size_t _recordSize;
+    size_t _fileCapacity;
+    size_t _keyCapacity;
+    size_t _readAheadItems;
+    size_t _readAheadBytes;
+    size_t _itemCount;
+    size_t _fileCount;
+    float _compactionRatio;
+    size_t _compactionStep;
+    DiskQueueStats _stats;
+    CompactionJob _compaction;
+    DiskQueueStorage* _storage;
     String _path;
     DiskQueuePolicy _policy;
+    bool _coalescing;
+    bool _segmentMarker;
     bool _running;
 };
@@ -0,0 +1,607 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DiskQueueStorage.h"
+#include <dirent.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+int DiskQueueStorage::transfer(int fd, off_t offset, size_t size, int out) {
+    if (offset != seek(fd, offset)) {
+        return -1;
+    }
+
+    uint8_t buffer[TransferCopySize];
+    size_t copied = 0;
+    while (copied < size) {
+        auto chunk = std::min(sizeof(buffer), size - copied);
+        auto ret = read(fd, buffer, chunk);
+        if (0 >= ret) {
+            break;
+        }
+        for (int written = 0; written < ret;) {
+            auto count = ::write(out, buffer + written, ret - written);
+            if (0 >= count) {
+                return -1;
+            }
+            written += count;
+        }
+        copied += ret;
+    }
+
+    return copied;
+}
+
+DiskQueuePosixStorage& DiskQueuePosixStorage::instance() {
+    static DiskQueuePosixStorage storage;
+    return storage;
+}
+
+int DiskQueuePosixStorage::open(const char* path, int flags) {
+    return ::open(path, flags, 0664);
+}
+
+int DiskQueuePosixStorage::close(int fd) {
+    return ::close(fd);
+}
+
+int DiskQueuePosixStorage::read(int fd, void* data, size_t size) {
+    return ::read(fd, data, size);
+}
+
+int DiskQueuePosixStorage::write(int fd, const void* data, size_t size) {
+    return ::write(fd, data, size);
+}
+
+off_t DiskQueuePosixStorage::seek(int fd, off_t offset) {
+    return ::lseek(fd, offset, SEEK_SET);
+}
+
+int DiskQueuePosixStorage::sync(int fd) {
+    return ::fsync(fd);
+}
+
+int DiskQueuePosixStorage::truncate(int fd, off_t size) {
+    return ::ftruncate(fd, size);
+}
+
+int DiskQueuePosixStorage::remove(const char* path) {
+    return ::unlink(path);
+}
+
+int DiskQueuePosixStorage::rename(const char* from, const char* to) {
+    return ::rename(from, to);
+}
+
+int DiskQueuePosixStorage::makeDirectory(const char* path) {
+    struct stat st = {};
+    if (!::stat(path, &st) && S_ISDIR(st.st_mode)) {
+        return 0;
+    }
+
+    return ::mkdir(path, 0775);
+}
+
+int DiskQueuePosixStorage::listDirectory(const char* path, DiskQueueListCallback callback, void* context) {
+    auto dir = ::opendir(path);
+    if (!dir) {
+        return -1;
+    }
+
+    int ret = 0;
+    struct dirent* ent = nullptr;
+    while (!ret && (nullptr != (ent = ::readdir(dir)))) {
+        if (DT_REG != ent->d_type) {
+            continue;
+        }
+
+        String filename = String(path) + "/" + String(ent->d_name);
+        struct stat st = {};
+        ::stat(filename, &st);
+        ret = callback(ent->d_name, st.st_size, context);
+    }
+
+    ::closedir(dir);
+
+    return ret;
+}
+
+int DiskQueuePosixStorage::transfer(int fd, off_t offset, size_t size, int out) {
+#if defined(__linux__)
+    size_t copied = 0;
+    bool sendFile = false;
+    while (copied < size) {
+        off_t position = offset + copied;
+        loff_t rangePosition = position;
+        ssize_t ret = sendFile ? ::sendfile(out, fd, &position, size - copied) :
+                                 ::copy_file_range(fd, &rangePosition, out, nullptr, size - copied, 0);
+        if (0 < ret) {
+            copied += ret;
+            continue;
+        }
+        if (0 == ret) {
+            break; // End of file
+        }
+        if (!sendFile && !copied) {
+            // copy_file_range() only copies between files, sendfile() also writes to pipes and sockets
+            sendFile = true;
+            continue;
+        }
+        if (!copied && ((EINVAL == errno) || (ENOSYS == errno))) {
+            return DiskQueueStorage::transfer(fd, offset, size, out);
+        }
+        return -1;
+    }
+
+    return copied;
+#else
+    return DiskQueueStorage::transfer(fd, offset, size, out);
+#endif
+}
+
+DiskQueueRamStorage::~DiskQueueRamStorage() {
+    for (auto& handle: _handles) {
+        // Removed files that were never closed are only referenced by their handles
+        if (handle.file && handle.file->removed && (0 == --handle.file->refs)) {
+            delete handle.file;
+        }
+    }
+    for (auto file: _files) {
+        delete file;
+    }
+}
+
+int DiskQueueRamStorage::open(const char* path, int flags) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    File* file = nullptr;
+    int index = findFile(path);
+    if (0 <= index) {
+        file = _files[index];
+        if ((flags & O_TRUNC) && !resizeFile(file, 0)) {
+            return -1;
+        }
+    } else {
+        if (!(flags & O_CREAT)) {
+            return -1;
+        }
+
+        // The directory must exist as it would on a file system
+        auto name = strrchr(path, '/');
+        if (name) {
+            String directory = String(path).substring(0, name - path);
+            bool found = false;
+            for (auto& entry: _directories) {
+                if (entry == directory) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                return -1;
+            }
+        }
+
+        file = new File();
+        if (!file) {
+            return -1;
+        }
+        file->path = path;
+        file->refs = 0;
+        file->removed = false;
+        if (!_files.append(file)) {
+            delete file;
+            return -1;
+        }
+    }
+
+    // Reuse the lowest free descriptor like a file system would
+    int fd = 0;
+    while ((fd < _handles.size()) && _handles[fd].file) {
+        ++fd;
+    }
+    if ((fd == _handles.size()) && !_handles.append(Handle())) {
+        return -1;
+    }
+
+    ++file->refs;
+    _handles[fd] = {file, 0, flags};
+
+    return fd;
+}
+
+int DiskQueueRamStorage::close(int fd) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle) {
+        return -1;
+    }
+
+    auto file = handle->file;
+    handle->file = nullptr;
+    if ((0 == --file->refs) && file->removed) {
+        _usage -= file->data.size();
+        delete file;
+    }
+
+    return 0;
+}
+
+int DiskQueueRamStorage::read(int fd, void* data, size_t size) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle || (O_WRONLY == (handle->flags & O_ACCMODE))) {
+        return -1;
+    }
+
+    size_t fileSize = handle->file->data.size();
+    if (handle->position >= fileSize) {
+        return 0;
+    }
+
+    size = std::min(size, fileSize - handle->position);
+    memcpy(data, handle->file->data.data() + handle->position, size);
+    handle->position += size;
+
+    return size;
+}
+
+int DiskQueueRamStorage::write(int fd, const void* data, size_t size) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle || (O_RDONLY == (handle->flags & O_ACCMODE))) {
+        return -1;
+    }
+
+    auto file = handle->file;
+    if (handle->flags & O_APPEND) {
+        handle->position = file->data.size();
+    }
+
+    size_t end = handle->position + size;
+    if ((end > (size_t)file->data.size()) && !resizeFile(file, end)) {
+        return -1;
+    }
+
+    memcpy(file->data.data() + handle->position, data, size);
+    handle->position = end;
+
+    return size;
+}
+
+off_t DiskQueueRamStorage::seek(int fd, off_t offset) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle || (0 > offset)) {
+        return -1;
+    }
+
+    handle->position = offset;
+
+    return offset;
+}
+
+int DiskQueueRamStorage::sync(int fd) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    return getHandle(fd) ? 0 : -1;
+}
+
+int DiskQueueRamStorage::truncate(int fd, off_t size) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle || (0 > size) || (O_RDONLY == (handle->flags & O_ACCMODE))) {
+        return -1;
+    }
+
+    return resizeFile(handle->file, size) ? 0 : -1;
+}
+
+int DiskQueueRamStorage::remove(const char* path) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int index = findFile(path);
+    if (0 > index) {
+        return -1;
+    }
+
+    removeFile(index);
+
+    return 0;
+}
+
+int DiskQueueRamStorage::rename(const char* from, const char* to) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int index = findFile(from);
+    if (0 > index) {
+        return -1;
+    }
+
+    auto file = _files[index];
+    int existing = findFile(to);
+    if ((0 <= existing) && (existing != index)) {
+        removeFile(existing);
+    }
+    file->path = to;
+
+    return 0;
+}
+
+int DiskQueueRamStorage::makeDirectory(const char* path) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    for (auto& entry: _directories) {
+        if (entry == path) {
+            return 0;
+        }
+    }
+
+    return _directories.append(String(path)) ? 0 : -1;
+}
+
+int DiskQueueRamStorage::listDirectory(const char* path, DiskQueueListCallback callback, void* context) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    bool found = false;
+    for (auto& entry: _directories) {
+        if (entry == path) {
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        return -1;
+    }
+
+    // Walk backwards so that the callback may remove the file it is called for
+    size_t length = strlen(path);
+    for (int i = _files.size() - 1; i >= 0; --i) {
+        auto filename = _files[i]->path.c_str();
+        if (strncmp(filename, path, length) || ('/' != filename[length]) ||
+            strchr(filename + length + 1, '/')) {
+            continue;
+        }
+
+        int ret = callback(filename + length + 1, _files[i]->data.size(), context);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+DiskQueueRamStorage::Handle* DiskQueueRamStorage::getHandle(int fd) {
+    if ((0 > fd) || (fd >= _handles.size()) || !_handles[fd].file) {
+        return nullptr;
+    }
+
+    return &_handles[fd];
+}
+
+int DiskQueueRamStorage::findFile(const char* path) {
+    for (int i = 0; i < _files.size(); ++i) {
+        if (_files[i]->path == path) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void DiskQueueRamStorage::removeFile(int index) {
+    auto file = _files[index];
+    _files.removeAt(index);
+
+    // Open descriptors keep the contents until they are closed
+    if (file->refs) {
+        file->removed = true;
+    } else {
+        _usage -= file->data.size();
+        delete file;
+    }
+}
+
+bool DiskQueueRamStorage::resizeFile(File* file, size_t size) {
+    size_t current = file->data.size();
+    if ((0 < _capacity) && (size > current) && ((_usage + (size - current)) > _capacity)) {
+        return false;
+    }
+    if (!file->data.resize(size)) {
+        return false;
+    }
+    _usage = _usage - current + size;
+
+    return true;
+}
+
+int DiskQueueFlashStorage::open(const char* path, int flags) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    bool created = (flags & O_CREAT) && (0 > findFile(path));
+    int fd = DiskQueueRamStorage::open(path, flags);
+    if ((0 <= fd) && (created || (flags & O_TRUNC))) {
+        charge(1, 0);
+    }
+
+    return fd;
+}
+
+int DiskQueueFlashStorage::write(int fd, const void* data, size_t size) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    auto handle = getHandle(fd);
+    if (!handle || !size) {
+        return DiskQueueRamStorage::write(fd, data, size);
+    }
+
+    size_t before = handle->file->data.size();
+    size_t start = (handle->flags & O_APPEND) ? before : handle->position;
+    int ret = DiskQueueRamStorage::write(fd, data, size);
+    if (0 < ret) {
+        // Pages spanned by the write, and blocks newly claimed by the file must be erased first
+        size_t end = start + ret;
+        size_t pages = ((end - 1) / _pageSize) - (start / _pageSize) + 1;
+        size_t blocksBefore = (before + _blockSize - 1) / _blockSize;
+        size_t blocksAfter = (std::max(before, end) + _blockSize - 1) / _blockSize;
+        _stats.bytesWritten += ret;
+        charge(pages, blocksAfter - blocksBefore);
+    }
+
+    return ret;
+}
+
+int DiskQueueFlashStorage::sync(int fd) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int ret = DiskQueueRamStorage::sync(fd);
+    if (!ret) {
+        ++_stats.syncs;
+        charge(1, 0);
+    }
+
+    return ret;
+}
+
+int DiskQueueFlashStorage::truncate(int fd, off_t size) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int ret = DiskQueueRamStorage::truncate(fd, size);
+    if (!ret) {
+        charge(1, 0);
+    }
+
+    return ret;
+}
+
+int DiskQueueFlashStorage::remove(const char* path) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int ret = DiskQueueRamStorage::remove(path);
+    if (!ret) {
+        charge(1, 0);
+    }
+
+    return ret;
+}
+
+int DiskQueueFlashStorage::rename(const char* from, const char* to) {
+    const std::lock_guard<RecursiveMutex> lock(_lock);
+
+    int ret = DiskQueueRamStorage::rename(from, to);
+    if (!ret) {
+        charge(1, 0);
+    }
+
+    return ret;
+}
+
+void DiskQueueFlashStorage::charge(size_t pages, size_t blocks) {
+    uint32_t us = (pages * _pageProgramUs) + (blocks * _blockEraseUs);
+    _stats.pagesProgrammed += pages;
+    _stats.blocksErased += blocks;
+    _stats.elapsedUs += us;
+
+    if (_realTime && us) {
+        if (us >= 1000) {
+            delay(us / 1000);
+        }
+        delayMicroseconds(us % 1000);
+    }
+}
+
+bool DiskQueueFaultStorage::step() {
+    if (_crashed) {
+        return false;
+    }
+
+    if ((++_steps != _faultStep) || (DiskQueueFault::Crash != _fault)) {
+        return true;
+    }
+
+    _crashed = true;
+    return false;
+}
+
+int DiskQueueFaultStorage::open(const char* path, int flags) {
+    return step() ? _storage.open(path, flags) : -1;
+}
+
+int DiskQueueFaultStorage::close(int fd) {
+    // Descriptors are released even after a crash so that the underlying storage can be reused
+    return _storage.close(fd);
+}
+
+int DiskQueueFaultStorage::read(int fd, void* data, size_t size) {
+    return step() ? _storage.read(fd, data, size) : -1;
+}
+
+int DiskQueueFaultStorage::write(int fd, const void* data, size_t size) {
+    if (_crashed) {
+        return -1;
+    }
+    if (++_steps != _faultStep) {
+        return _storage.write(fd, data, size);
+    }
+
+    // The faulted write is torn, leaving the first half of its data behind
+    int ret = (1 < size) ? _storage.write(fd, data, size / 2) : 0;
+    if (DiskQueueFault::Crash == _fault) {
+        _crashed = true;
+        return -1;
+    }
+    return ret;
+}
+
+off_t DiskQueueFaultStorage::seek(int fd, off_t offset) {
+    return step() ? _storage.seek(fd, offset) : -1;
+}
+
+int DiskQueueFaultStorage::sync(int fd) {
+    return step() ? _storage.sync(fd) : -1;
+}
+
+int DiskQueueFaultStorage::truncate(int fd, off_t size) {
+    return step() ? _storage.truncate(fd, size) : -1;
+}
+
+int DiskQueueFaultStorage::remove(const char* path) {
+    return step() ? _storage.remove(path) : -1;
+}
+
+int DiskQueueFaultStorage::rename(const char* from, const char* to) {
+    return step() ? _storage.rename(from, to) : -1;
+}
+
+int DiskQueueFaultStorage::makeDirectory(const char* path) {
+    return step() ? _storage.makeDirectory(path) : -1;
+}
+
+int DiskQueueFaultStorage::listDirectory(const char* path, DiskQueueListCallback callback, void* context) {
+    return step() ? _storage.listDirectory(path, callback, context) : -1;
+}
+
+int DiskQueueFaultStorage::transfer(int fd, off_t offset, size_t size, int out) {
+    return step() ? _storage.transfer(fd, offset, size, out) : -1;
+}
@@ -0,0 +1,490 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "Particle.h"
+#include <fcntl.h>
+
+/**
+ * @brief Called for each regular file found by DiskQueueStorage::listDirectory().
+ *
+ * @param[in]   name            File name without the directory path
+ * @param[in]   size            File size in bytes
+ * @param[in]   context         Context pointer given to listDirectory()
+ * @return int Zero to continue listing, otherwise listing stops and this value is returned
+ */
+typedef int (*DiskQueueListCallback)(const char* name, size_t size, void* context);
+
+/**
+ * @brief The <code>DiskQueueStorage</code> class is the interface through which a
+ * <code>DiskQueue</code> accesses its files.  Methods follow the POSIX calls they replace:
+ * descriptors are non-negative, counts are returned on success and -1 on failure.
+ *
+ */
+class DiskQueueStorage {
+public:
+    virtual ~DiskQueueStorage() = default;
+
+    /**
+     * @brief Open a file.
+     *
+     * @param[in]   path            Full file path
+     * @param[in]   flags           POSIX open flags, O_RDONLY, O_WRONLY or O_RDWR with O_CREAT, O_TRUNC and O_APPEND
+     * @return int File descriptor.  -1 on failure.
+     */
+    virtual int open(const char* path, int flags) = 0;
+
+    /**
+     * @brief Close a file descriptor.
+     *
+     * @param[in]   fd              File descriptor
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int close(int fd) = 0;
+
+    /**
+     * @brief Read from the current position of a file.
+     *
+     * @param[in]   fd              File descriptor
+     * @param[out]  data            Buffer to read into
+     * @param[in]   size            Maximum number of bytes to read
+     * @return int Number of bytes read, -1 on failure
+     */
+    virtual int read(int fd, void* data, size_t size) = 0;
+
+    /**
+     * @brief Write at the current position of a file, or at its end if opened with O_APPEND.
+     *
+     * @param[in]   fd              File descriptor
+     * @param[in]   data            Data to write
+     * @param[in]   size            Number of bytes to write
+     * @return int Number of bytes written, -1 on failure
+     */
+    virtual int write(int fd, const void* data, size_t size) = 0;
+
+    /**
+     * @brief Set the current position of a file.
+     *
+     * @param[in]   fd              File descriptor
+     * @param[in]   offset          Offset from the start of the file
+     * @return off_t New position, -1 on failure
+     */
+    virtual off_t seek(int fd, off_t offset) = 0;
+
+    /**
+     * @brief Commit written data of a file to the medium.
+     *
+     * @param[in]   fd              File descriptor
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int sync(int fd) = 0;
+
+    /**
+     * @brief Truncate a file to the given size.
+     *
+     * @param[in]   fd              File descriptor
+     * @param[in]   size            New file size
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int truncate(int fd, off_t size) = 0;
+
+    /**
+     * @brief Remove a file.  Descriptors that are still open remain readable.
+     *
+     * @param[in]   path            Full file path
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int remove(const char* path) = 0;
+
+    /**
+     * @brief Rename a file, atomically replacing any existing file at the new path.
+     *
+     * @param[in]   from            Current full file path
+     * @param[in]   to              New full file path
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int rename(const char* from, const char* to) = 0;
+
+    /**
+     * @brief Create a directory unless it already exists.  Intermediate directories are not created.
+     *
+     * @param[in]   path            Full directory path
+     * @return int Zero on success, -1 on failure
+     */
+    virtual int makeDirectory(const char* path) = 0;
+
+    /**
+     * @brief Call the given callback for each regular file in a directory.  The callback may
+     * remove the file it is called for.
+     *
+     * @param[in]   path            Full directory path
+     * @param[in]   callback        Callback called for each file
+     * @param[in]   context         Context pointer passed to the callback
+     * @return int Zero on success, -1 if the directory cannot be read, otherwise the value returned by the callback
+     */
+    virtual int listDirectory(const char* path, DiskQueueListCallback callback, void* context) = 0;
+
+    /**
+     * @brief Copy bytes of a file to a descriptor of the operating system, such as a file, pipe
+     * or socket.  The default implementation reads the file through a stack buffer and leaves the
+     * file position undefined.
+     *
+     * @param[in]   fd              File descriptor of this storage
+     * @param[in]   offset          Offset of the first byte to copy
+     * @param[in]   size            Number of bytes to copy
+     * @param[in]   out             Operating system file descriptor to write to
+     * @return int Number of bytes copied, -1 on failure
+     */
+    virtual int transfer(int fd, off_t offset, size_t size, int out);
+
+protected:
+    static constexpr size_t TransferCopySize = 64;      //< Size of the stack buffer used by transfer()
+};
+
+/**
+ * @brief Storage on the device file system using POSIX calls.  This is the default storage of
+ * every <code>DiskQueue</code>.
+ *
+ */
+class DiskQueuePosixStorage final : public DiskQueueStorage {
+public:
+    /**
+     * @brief Get the shared instance.  The class holds no state so one instance serves all queues.
+     *
+     * @return DiskQueuePosixStorage& Shared instance
+     */
+    static DiskQueuePosixStorage& instance();
+
+    int open(const char* path, int flags) override;
+    int close(int fd) override;
+    int read(int fd, void* data, size_t size) override;
+    int write(int fd, const void* data, size_t size) override;
+    off_t seek(int fd, off_t offset) override;
+    int sync(int fd) override;
+    int truncate(int fd, off_t size) override;
+    int remove(const char* path) override;
+    int rename(const char* from, const char* to) override;
+    int makeDirectory(const char* path) override;
+    int listDirectory(const char* path, DiskQueueListCallback callback, void* context) override;
+
+    /**
+     * @brief Copy bytes of a file to a descriptor of the operating system.  On Linux the bytes
+     * are copied within the kernel with copy_file_range() or sendfile() and the file position is
+     * left unchanged.
+     *
+     * @param[in]   fd              File descriptor
+     * @param[in]   offset          Offset of the first byte to copy
+     * @param[in]   size            Number of bytes to copy
+     * @param[in]   out             Operating system file descriptor to write to
+     * @return int Number of bytes copied, -1 on failure
+     */
+    int transfer(int fd, off_t offset, size_t size, int out) override;
+};
+
+/**
+ * @brief Storage held entirely in RAM.  Contents are lost on reset, which suits queues of data
+ * that is worthless after a reboot as well as testing and benchmarking without file system
+ * latency.  File contents are allocated from the heap as they grow.
+ *
+ */
+class DiskQueueRamStorage : public DiskQueueStorage {
+public:
+    /**
+     * @brief Construct a new DiskQueueRamStorage object
+     *
+     * @param[in]   capacity        Maximum number of bytes held by all files, zero for no limit
+     */
+    DiskQueueRamStorage(size_t capacity = 0)
+    : _capacity(capacity),
+      _usage(0) {
+
+    }
+
+    /**
+     * @brief Destroy the DiskQueueRamStorage object and release all file contents
+     *
+     */
+    virtual ~DiskQueueRamStorage();
+
+    /**
+     * @brief Get the number of bytes held by all files, including removed files that are still open.
+     *
+     * @return size_t Size in bytes.
+     */
+    size_t getUsage() const {
+        return _usage;
+    }
+
+    int open(const char* path, int flags) override;
+    int close(int fd) override;
+    int read(int fd, void* data, size_t size) override;
+    int write(int fd, const void* data, size_t size) override;
+    off_t seek(int fd, off_t offset) override;
+    int sync(int fd) override;
+    int truncate(int fd, off_t size) override;
+    int remove(const char* path) override;
+    int rename(const char* from, const char* to) override;
+    int makeDirectory(const char* path) override;
+    int listDirectory(const char* path, DiskQueueListCallback callback, void* context) override;
+
+protected:
+    struct File {
+        String path;                //< Full file path
+        Vector<uint8_t> data;       //< File contents
+        int refs;                   //< Number of open descriptors
+        bool removed;               //< File has been removed and is released once closed
+    };
+
+    struct Handle {
+        File* file;                 //< Open file, nullptr if the descriptor is free
+        size_t position;            //< Current position
+        int flags;                  //< Open flags
+    };
+
+    /**
+     * @brief Get the open handle of a file descriptor.
+     *
+     * @param[in]   fd              File descriptor
+     * @return Handle* Open handle.  nullptr if the descriptor is not open.
+     */
+    Handle* getHandle(int fd);
+
+    /**
+     * @brief Find a file that has not been removed.
+     *
+     * @param[in]   path            Full file path
+     * @return int Index into the file list.  -1 if not found.
+     */
+    int findFile(const char* path);
+
+    /**
+     * @brief Remove a file from the file list and release it unless it is still open.
+     *
+     * @param[in]   index           Index into the file list
+     */
+    void removeFile(int index);
+
+    /**
+     * @brief Resize the contents of a file within the storage capacity.
+     *
+     * @param[in]   file            File to resize
+     * @param[in]   size            New size in bytes
+     * @return true File has been resized
+     * @return false Not enough capacity or memory
+     */
+    bool resizeFile(File* file, size_t size);
+
+    RecursiveMutex _lock;
+    Vector<File*> _files;
+    Vector<Handle> _handles;
+    Vector<String> _directories;
+    size_t _capacity;
+    size_t _usage;
+};
+
+/**
+ * @brief Cost counters of simulated flash storage
+ */
+struct DiskQueueFlashStats {
+    uint64_t elapsedUs;             //< Simulated time spent programming and erasing
+    size_t bytesWritten;            //< Bytes written by the queue
+    size_t pagesProgrammed;         //< Pages programmed, including partial pages and metadata commits
+    size_t blocksErased;            //< Erase blocks erased before first use
+    size_t syncs;                   //< Number of sync calls
+};
+
+/**
+ * @brief RAM storage that simulates the cost of a NOR flash file system.  Every write programs
+ * the pages it touches, every file block is erased before it is first written, and creating,
+ * renaming, truncating, removing and syncing each commit one metadata page.  Clearing bits of
+ * data already written, such as tombstoning an item, needs no erase on NOR flash and is charged
+ * as a page program.  The accumulated cost is reported by getStats() and may optionally be
+ * applied as real delays to expose the queue to flash write latency.
+ *
+ */
+class DiskQueueFlashStorage : public DiskQueueRamStorage {
+public:
+    /**
+     * @brief Construct a new DiskQueueFlashStorage object
+     *
+     * @param[in]   capacity        Maximum number of bytes held by all files, zero for no limit
+     * @param[in]   blockSize       Erase block size in bytes
+     * @param[in]   pageSize        Program page size in bytes
+     * @param[in]   pageProgramUs   Time to program one page in microseconds
+     * @param[in]   blockEraseUs    Time to erase one block in microseconds
+     */
+    DiskQueueFlashStorage(size_t capacity = 0, size_t blockSize = 4096, size_t pageSize = 256,
+        uint32_t pageProgramUs = 700, uint32_t blockEraseUs = 50000)
+    : DiskQueueRamStorage(capacity),
+      _blockSize(blockSize ? blockSize : 1),
+      _pageSize(pageSize ? pageSize : 1),
+      _pageProgramUs(pageProgramUs),
+      _blockEraseUs(blockEraseUs),
+      _stats(),
+      _realTime(false) {
+
+    }
+
+    /**
+     * @brief Apply simulated costs as real delays in the calling thread.
+     *
+     * @param[in]   enable          True to delay, false to only count costs
+     */
+    void setRealTime(bool enable) {
+        _realTime = enable;
+    }
+
+    /**
+     * @brief Get the accumulated cost counters.
+     *
+     * @return DiskQueueFlashStats Cost counters
+     */
+    DiskQueueFlashStats getStats() const {
+        return _stats;
+    }
+
+    /**
+     * @brief Reset the accumulated cost counters.
+     *
+     */
+    void resetStats() {
+        _stats = {};
+    }
+
+    int open(const char* path, int flags) override;
+    int write(int fd, const void* data, size_t size) override;
+    int sync(int fd) override;
+    int truncate(int fd, off_t size) override;
+    int remove(const char* path) override;
+    int rename(const char* from, const char* to) override;
+
+private:
+    /**
+     * @brief Account for programming pages and erasing blocks.
+     *
+     * @param[in]   pages           Number of pages programmed
+     * @param[in]   blocks          Number of blocks erased
+     */
+    void charge(size_t pages, size_t blocks);
+
+    size_t _blockSize;
+    size_t _pageSize;
+    uint32_t _pageProgramUs;
+    uint32_t _blockEraseUs;
+    DiskQueueFlashStats _stats;
+    bool _realTime;
+};
+
+/**
+ * @brief Kind of fault injected by DiskQueueFaultStorage
+ */
+enum class DiskQueueFault {
+    Crash,                          //< The step writes part of its data and fails, as do all later steps
+    ShortWrite                      //< The step, if it is a write, writes part of its data and reports it
+};
+
+/**
+ * @brief Storage that forwards to another storage and injects a fault at a chosen I/O step, for
+ * checking that a queue recovers from interrupted writes.  Every call except close() is a step.
+ * After a crash the queue is abandoned and a new one is started on the underlying storage, which
+ * holds exactly what was written before the crash.
+ *
+ */
+class DiskQueueFaultStorage : public DiskQueueStorage {
+public:
+    /**
+     * @brief Construct a new DiskQueueFaultStorage object
+     *
+     * @param[in]   storage         Storage holding the files
+     */
+    DiskQueueFaultStorage(DiskQueueStorage& storage)
+    : _storage(storage),
+      _steps(0),
+      _faultStep(0),
+      _fault(DiskQueueFault::Crash),
+      _crashed(false) {
+
+    }
+
+    /**
+     * @brief Inject a fault at the given step, counted from the last call to reset().
+     *
+     * @param[in]   step            Step to fail, starting at one.  Zero for no fault.
+     * @param[in]   fault           Kind of fault
+     */
+    void setFault(size_t step, DiskQueueFault fault = DiskQueueFault::Crash) {
+        _faultStep = step;
+        _fault = fault;
+    }
+
+    /**
+     * @brief Restart step counting and clear the crashed state and the fault.
+     *
+     */
+    void reset() {
+        _steps = 0;
+        _faultStep = 0;
+        _crashed = false;
+    }
+
+    /**
+     * @brief Get the number of steps performed since the last call to reset().
+     *
+     * @return size_t Number of steps
+     */
+    size_t getSteps() const {
+        return _steps;
+    }
+
+    /**
+     * @brief Whether a crash was injected.
+     *
+     * @return true All steps fail until reset
+     * @return false Steps are forwarded
+     */
+    bool crashed() const {
+        return _crashed;
+    }
+
+    int open(const char* path, int flags) override;
+    int close(int fd) override;
+    int read(int fd, void* data, size_t size) override;
+    int write(int fd, const void* data, size_t size) override;
+    off_t seek(int fd, off_t offset) override;
+    int sync(int fd) override;
+    int truncate(int fd, off_t size) override;
+    int remove(const char* path) override;
+    int rename(const char* from, const char* to) override;
+    int makeDirectory(const char* path) override;
+    int listDirectory(const char* path, DiskQueueListCallback callback, void* context) override;
+    int transfer(int fd, off_t offset, size_t size, int out) override;
+
+private:
+    /**
+     * @brief Count a step and check whether it is to be forwarded.
+     *
+     * @return true Forward the step
+     * @return false Fail the step, the storage has crashed
+     */
+    bool step();
+
+    DiskQueueStorage& _storage;
+    size_t _steps;
+    size_t _faultStep;
+    DiskQueueFault _fault;
+    bool _crashed;
+};
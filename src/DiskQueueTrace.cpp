@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DiskQueueTrace.h"
+
+#ifdef DISKQUEUE_TRACE
+
+#include <functional>
+#include <thread>
+
+DiskQueueTraceEvent DiskQueueTrace::_events[DISKQUEUE_TRACE_EVENTS];
+std::atomic<uint32_t> DiskQueueTrace::_next(0);
+
+// Write all of the given bytes to a file descriptor
+static bool writeAll(int fd, const char* data, size_t size) {
+    while (0 < size) {
+        auto ret = ::write(fd, data, size);
+        if (0 >= ret) {
+            return false;
+        }
+        data += ret;
+        size -= ret;
+    }
+
+    return true;
+}
+
+void DiskQueueTrace::record(const char* name, uint32_t start, uint32_t duration) {
+    // Claiming a slot is the only synchronization so recording never blocks on a lock
+    uint32_t index = _next.fetch_add(1, std::memory_order_relaxed) % DISKQUEUE_TRACE_EVENTS;
+    auto thread = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+    _events[index] = { name, start, duration, thread };
+}
+
+size_t DiskQueueTrace::count() {
+    return std::min<uint32_t>(_next.load(std::memory_order_relaxed), DISKQUEUE_TRACE_EVENTS);
+}
+
+void DiskQueueTrace::clear() {
+    _next.store(0, std::memory_order_relaxed);
+}
+
+int DiskQueueTrace::dump(int fd) {
+    uint32_t next = _next.load(std::memory_order_relaxed);
+    uint32_t count = std::min<uint32_t>(next, DISKQUEUE_TRACE_EVENTS);
+
+    static const char header[] = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    CHECK_TRUE(writeAll(fd, header, sizeof(header) - 1), SYSTEM_ERROR_IO);
+
+    // Oldest first, starting past the newest event once the buffer has wrapped
+    char line[160];
+    for (uint32_t i = 0; i < count; ++i) {
+        auto& event = _events[(next - count + i) % DISKQUEUE_TRACE_EVENTS];
+        int length = snprintf(line, sizeof(line),
+            "%s\n{\"name\":\"%s\",\"cat\":\"DiskQueue\",\"ph\":\"X\",\"ts\":%lu,\"dur\":%lu,\"pid\":1,\"tid\":%lu}",
+            i ? "," : "", event.name ? event.name : "", (unsigned long)event.start,
+            (unsigned long)event.duration, (unsigned long)event.thread);
+        CHECK_TRUE(0 < length, SYSTEM_ERROR_IO);
+        CHECK_TRUE(writeAll(fd, line, std::min<size_t>(length, sizeof(line) - 1)), SYSTEM_ERROR_IO);
+    }
+
+    static const char footer[] = "\n]}\n";
+    CHECK_TRUE(writeAll(fd, footer, sizeof(footer) - 1), SYSTEM_ERROR_IO);
+
+    return (int)count;
+}
+
+#endif // DISKQUEUE_TRACE
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/**
+ * Trace points are compiled in by defining DISKQUEUE_TRACE, for example with
+ * `EXTRA_CFLAGS += -DDISKQUEUE_TRACE`.  Otherwise the trace macros expand to nothing and
+ * DiskQueueTrace is not declared.
+ */
+
+#ifdef DISKQUEUE_TRACE
+
+#include "Particle.h"
+#include <atomic>
+
+#ifndef DISKQUEUE_TRACE_EVENTS
+#define DISKQUEUE_TRACE_EVENTS 512      //< Number of events held by the ring buffer
+#endif
+
+/**
+ * @brief A completed trace event
+ */
+struct DiskQueueTraceEvent {
+    const char* name;               //< Static name of the operation or phase
+    uint32_t start;                 //< Start time in microseconds
+    uint32_t duration;              //< Duration in microseconds
+    uint32_t thread;                //< Identifier of the recording thread
+};
+
+/**
+ * @brief The <code>DiskQueueTrace</code> class holds the most recent trace events of all queues
+ * in a fixed-size ring buffer.
+ *
+ */
+class DiskQueueTrace {
+public:
+    /**
+     * @brief Record a completed event, overwriting the oldest one once the buffer is full.
+     *
+     * @param[in]   name            Static name of the operation or phase
+     * @param[in]   start           Start time in microseconds
+     * @param[in]   duration        Duration in microseconds
+     */
+    static void record(const char* name, uint32_t start, uint32_t duration);
+
+    /**
+     * @brief Get the number of events held.
+     *
+     * @return size_t Number of events
+     */
+    static size_t count();
+
+    /**
+     * @brief Discard all events.
+     *
+     */
+    static void clear();
+
+    /**
+     * @brief Write the events held as Chrome trace-event JSON, which can be loaded by
+     * chrome://tracing or Perfetto.  Events recorded while dumping may be torn.
+     *
+     * @param[in]   fd              File descriptor to write to
+     * @return int Number of events written, or SYSTEM_ERROR_IO
+     */
+    static int dump(int fd);
+
+private:
+    static DiskQueueTraceEvent _events[DISKQUEUE_TRACE_EVENTS];
+    static std::atomic<uint32_t> _next;
+};
+
+/**
+ * @brief Records an event from construction to destruction, and an event for each phase within it.
+ *
+ */
+class DiskQueueTraceScope {
+public:
+    DiskQueueTraceScope(const char* name)
+    : _name(name),
+      _phase(nullptr),
+      _start(micros()),
+      _phaseStart(0) {
+
+    }
+
+    ~DiskQueueTraceScope() {
+        uint32_t now = micros();
+        endPhase(now);
+        DiskQueueTrace::record(_name, _start, now - _start);
+    }
+
+    /**
+     * @brief End the current phase, if any, and start the next one.
+     *
+     * @param[in]   name            Static name of the phase
+     */
+    void phase(const char* name) {
+        uint32_t now = micros();
+        endPhase(now);
+        _phase = name;
+        _phaseStart = now;
+    }
+
+private:
+    void endPhase(uint32_t now) {
+        if (_phase) {
+            DiskQueueTrace::record(_phase, _phaseStart, now - _phaseStart);
+        }
+    }
+
+    const char* _name;
+    const char* _phase;
+    uint32_t _start;
+    uint32_t _phaseStart;
+};
+
+// Trace the enclosing block, at most once per block
+#define DISKQUEUE_TRACE_SCOPE(_name) DiskQueueTraceScope diskQueueTraceScope(_name)
+// Start the next phase of the traced block, ending the previous one
+#define DISKQUEUE_TRACE_PHASE(_name) diskQueueTraceScope.phase(_name)
+
+#else
+
+#define DISKQUEUE_TRACE_SCOPE(_name)
+#define DISKQUEUE_TRACE_PHASE(_name)
+
+#endif // DISKQUEUE_TRACE
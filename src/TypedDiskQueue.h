@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+#include "DiskQueue.h"
+
+/**
+ * @brief Serializer used for trivially copyable types.  Values are stored as their raw bytes
+ * without any intermediate buffer.
+ *
+ * @tparam T Trivially copyable item type
+ */
+template <typename T>
+struct DiskQueueRawSerializer {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Type must be trivially copyable or have a DiskQueueSerializer specialization");
+
+    static constexpr size_t FixedSize = sizeof(T);      //< Every value is stored in exactly this many bytes
+    static constexpr size_t MaxSize = sizeof(T);        //< Largest serialized value in bytes
+};
+
+/**
+ * @brief Serialization traits for items of a <code>TypedDiskQueue</code>.  Specialize for types
+ * that are not trivially copyable, for example:
+ *
+ * @code
+ * template <>
+ * struct DiskQueueSerializer<MyType> {
+ *     static constexpr size_t FixedSize = 0;   // Non-zero if every value serializes to this many bytes
+ *     static constexpr size_t MaxSize = 64;    // Largest serialized value, also the stack buffer size
+ *     static size_t serialize(const MyType& value, uint8_t* data, size_t size);     // Bytes written, zero on failure
+ *     static bool deserialize(const uint8_t* data, size_t size, MyType& value);
+ * };
+ * @endcode
+ *
+ * @tparam T Item type
+ */
+template <typename T>
+struct DiskQueueSerializer : DiskQueueRawSerializer<T> {
+};
+
+/**
+ * @brief The <code>TypedDiskQueue</code> class is a <code>DiskQueue</code> holding items of a
+ * single type.  Fixed size types are stored as compact records without an item length.
+ *
+ * @tparam T Item type
+ */
+template <typename T>
+class TypedDiskQueue : public DiskQueue {
+    using Serializer = DiskQueueSerializer<T>;
+
+    static constexpr bool Raw = std::is_base_of<DiskQueueRawSerializer<T>, Serializer>::value;
+
+    static_assert(0 < Serializer::MaxSize, "Serialized items must not be empty");
+    static_assert(UINT16_MAX >= Serializer::MaxSize, "Serialized items must fit a 16-bit item length");
+    static_assert(Serializer::MaxSize >= Serializer::FixedSize, "Fixed size must not exceed the maximum size");
+
+public:
+    /**
+     * @brief Construct a new TypedDiskQueue object with the given disk limit
+     *
+     * @param[in]   diskLimit       Total disk space reserved for queue
+     */
+    TypedDiskQueue(size_t diskLimit = 0)
+    : DiskQueue(diskLimit) {
+        setRecordSize(Serializer::FixedSize);
+    }
+
+    /**
+     * @brief Push value to write queue if space available
+     *
+     * @param[in]      value    Value to push
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushBack(const T& value) {
+        return push(value, false, 0, std::integral_constant<bool, Raw>());
+    }
+
+    /**
+     * @brief Push keyed value to write queue if space available
+     *
+     * @param[in]      value    Value to push
+     * @param[in]      key      Coalescing key for the item
+     * @return true Item has been pushed
+     * @return false Item has not been pushed
+     */
+    bool pushBackKeyed(const T& value, uint32_t key) {
+        return push(value, true, key, std::integral_constant<bool, Raw>());
+    }
+
+    /**
+     * @brief Inspect value from read queue if available.
+     *
+     * @param[out]     value    Value read from the queue
+     * @return true Value has been read
+     * @return false No item is available or the front item is not a valid value, for example an
+     * item of another size pushed through the DiskQueue interface
+     */
+    bool peekFront(T& value) {
+        return peek(value, std::integral_constant<bool, Raw>());
+    }
+
+private:
+    bool push(const T& value, bool keyed, uint32_t key, std::true_type /* raw */) {
+        auto data = reinterpret_cast<const uint8_t*>(&value);
+        return keyed ? DiskQueue::pushBackKeyed(data, sizeof(T), key) : DiskQueue::pushBack(data, sizeof(T));
+    }
+
+    bool push(const T& value, bool keyed, uint32_t key, std::false_type /* raw */) {
+        uint8_t data[Serializer::MaxSize];
+        auto size = Serializer::serialize(value, data, sizeof(data));
+        if (!size) {
+            return false;
+        }
+        return keyed ? DiskQueue::pushBackKeyed(data, size, key) : DiskQueue::pushBack(data, size);
+    }
+
+    // Reads are truncated to the buffer, so the byte past the largest value shows a longer item
+    // pushed through the DiskQueue interface
+
+    bool peek(T& value, std::true_type /* raw */) {
+        uint8_t data[sizeof(T) + 1];
+        size_t size = sizeof(data);
+        if (!DiskQueue::peekFront(data, size) || (sizeof(T) != size)) {
+            return false;
+        }
+        memcpy(&value, data, sizeof(T));
+        return true;
+    }
+
+    bool peek(T& value, std::false_type /* raw */) {
+        uint8_t data[Serializer::MaxSize + 1];
+        size_t size = sizeof(data);
+        return DiskQueue::peekFront(data, size) && (Serializer::MaxSize >= size) &&
+               Serializer::deserialize(data, size, value);
+    }
+};
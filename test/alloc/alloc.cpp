@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that pushing, peeking and popping a queue with a fixed capacity does not allocate memory
+
+#include "Particle.h"
+#include "DiskQueue.h"
+#include <new>
+
+static const size_t CYCLES = 3000;
+static const size_t WARMUP_CYCLES = 300;
+
+static bool counting = false;
+static size_t allocations = 0;
+
+void* operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t size) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    free(ptr);
+}
+
+enum class Mode {
+    Plain,
+    Compacted,
+    Coalescing,
+};
+
+static const char* modeName(Mode mode) {
+    switch (mode) {
+        case Mode::Compacted: return "segmented and compacted";
+        case Mode::Coalescing: return "coalescing with read-ahead";
+        default: return "plain";
+    }
+}
+
+// Push an item each cycle and peek and pop every third, keyed every fourth unless plain
+static void cycle(DiskQueue& queue, Mode mode, size_t i) {
+    char data[16];
+    snprintf(data, sizeof(data), "item%06u", (unsigned)i);
+    if ((Mode::Plain != mode) && (0 == (i % 4))) {
+        queue.pushBackKeyed(data, (uint32_t)(i % 8));
+    } else {
+        queue.pushBack(data);
+    }
+
+    if (0 == (i % 3)) {
+        uint8_t item[sizeof(data)];
+        size_t size = sizeof(item);
+        queue.peekFrontSize();
+        queue.peekFront(item, size);
+        queue.popFront();
+    }
+}
+
+static bool run(Mode mode) {
+    DiskQueue queue(64 * 1024);
+    queue.setCapacity(64, 8);
+    if (Mode::Compacted == mode) {
+        // Superseded keyed items leave the holes that compaction recovers
+        queue.setCoalescing(true);
+        queue.setSegmentSize(256);
+        queue.setCompaction(0.3f, 64);
+    } else if (Mode::Coalescing == mode) {
+        queue.setCoalescing(true);
+        queue.setReadAhead(4, 128);
+    }
+    if (SYSTEM_ERROR_NONE != queue.start("alloc_queue")) {
+        Log.error("%s: start failed", modeName(mode));
+        return false;
+    }
+    queue.unlinkFiles();
+
+    // The file list fills up and evicts during warm up, so the cycles measured run in a steady state
+    for (size_t i = 0; i < WARMUP_CYCLES; i++) {
+        cycle(queue, mode, i);
+    }
+
+    allocations = 0;
+    counting = true;
+    for (size_t i = 0; i < CYCLES; i++) {
+        cycle(queue, mode, i);
+    }
+    counting = false;
+
+    auto stats = queue.getStats();
+    Log.info("%s: %u allocations in %u cycles, %u items in %u files, %u compactions", modeName(mode),
+        (unsigned)allocations, (unsigned)CYCLES, (unsigned)stats.itemsTotal, (unsigned)stats.filesTotal,
+        (unsigned)stats.compactionRuns);
+
+    queue.unlinkFiles();
+    queue.stop();
+    return (0 == allocations) && ((Mode::Compacted != mode) || (0 < stats.compactionRuns));
+}
+
+int main() {
+    bool passed = true;
+    for (auto mode : { Mode::Plain, Mode::Compacted, Mode::Coalescing }) {
+        passed = run(mode) && passed;
+    }
+    return passed ? 0 : 1;
+}
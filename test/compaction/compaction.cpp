@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that compaction recovers holes left by tombstoned items and leaves popped items alone
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+static const unsigned ITEMS = 200;
+
+static bool expect(bool condition, const char* name, const char* what) {
+    if (!condition) {
+        Log.error("%s: %s", name, what);
+    }
+    return condition;
+}
+
+static void startQueue(DiskQueue& queue, DiskQueueRamStorage& ram) {
+    queue.setStorage(&ram);
+    queue.setCoalescing(true);
+    queue.setSegmentSize(1024);
+    queue.setCompaction(0.5f);
+    queue.start("/compaction", 64 * 1024);
+}
+
+// Popped items leave dead space only ahead of the remaining items, also when found by a restart
+static bool fifo() {
+    const char* name = "fifo";
+    DiskQueueRamStorage ram;
+    bool passed = true;
+    {
+        DiskQueue queue;
+        startQueue(queue, ram);
+        for (unsigned i = 0; i < ITEMS; i++) {
+            char item[16];
+            snprintf(item, sizeof(item), "item%05u", i);
+            queue.pushBack(item);
+            if (i & 1) {
+                queue.popFront();
+            }
+        }
+
+        // Leave the front segment mostly consumed
+        for (unsigned i = 0; i < ITEMS / 4; i++) {
+            queue.popFront();
+        }
+        passed = expect(0 == queue.getStats().compactionRuns, name, "popped items compacted") && passed;
+    }
+
+    DiskQueue queue;
+    startQueue(queue, ram);
+    for (unsigned i = 0; i < 10; i++) {
+        queue.pushBack("restarted");
+    }
+    passed = expect(0 == queue.getStats().compactionRuns, name, "popped items compacted after a restart") && passed;
+    return passed;
+}
+
+// Superseding keyed items leaves holes among the queued items, which are compacted away
+static bool coalescing() {
+    const char* name = "coalescing";
+    DiskQueueRamStorage ram;
+    DiskQueue queue;
+    startQueue(queue, ram);
+    for (unsigned i = 0; i < ITEMS; i++) {
+        char item[16];
+        snprintf(item, sizeof(item), "item%05u", i);
+        queue.pushBackKeyed(item, i % 4);
+    }
+    bool passed = expect(0 < queue.getStats().compactionRuns, name, "holes not compacted");
+    passed = expect(4 == queue.size(), name, "superseded items left") && passed;
+    for (unsigned i = ITEMS - 4; passed && (i < ITEMS); i++) {
+        char item[16] = {};
+        char expected[16];
+        size_t size = sizeof(item) - 1;
+        snprintf(expected, sizeof(expected), "item%05u", i);
+        passed = expect(queue.peekFront((uint8_t*)item, size) && !strcmp(item, expected), name, "wrong item read");
+        queue.popFront();
+    }
+    return passed;
+}
+
+// compact() works through the holes on its own when automatic compaction is disabled
+static bool manual() {
+    const char* name = "manual";
+    DiskQueueRamStorage ram;
+    DiskQueue queue;
+    startQueue(queue, ram);
+    queue.setCompaction(0.0f);
+    // Unkeyed items keep the older segments from being emptied entirely
+    for (unsigned i = 0; i < ITEMS; i++) {
+        char item[16];
+        snprintf(item, sizeof(item), "item%05u", i);
+        if (i & 1) {
+            queue.pushBack(item);
+        } else {
+            queue.pushBackKeyed(item, (i / 2) % 4);
+        }
+    }
+    bool passed = expect(0 == queue.getStats().compactionRuns, name, "compacted automatically");
+
+    size_t steps = 0;
+    while (queue.compact() && (steps < ITEMS)) {
+        steps++;
+    }
+    passed = expect(0 < queue.getStats().compactionRuns, name, "holes not compacted") && passed;
+    passed = expect((ITEMS / 2 + 4) == queue.size(), name, "items lost or superseded items left") && passed;
+    return passed;
+}
+
+int main() {
+    bool passed = fifo();
+    passed = coalescing() && passed;
+    passed = manual() && passed;
+    return passed ? 0 : 1;
+}
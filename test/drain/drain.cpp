@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that draining removes exactly the items exported, also when files ahead of them are unreadable
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+static int collect(const uint8_t* data, size_t size, void* context) {
+    ((std::string*)context)->append((const char*)data, size);
+    return SYSTEM_ERROR_NONE;
+}
+
+static bool expect(bool condition, const char* name, const char* what) {
+    if (!condition) {
+        Log.error("%s: %s", name, what);
+    }
+    return condition;
+}
+
+// An unreadable file between two items is skipped by the export and must not shift the removal
+static bool unreadableFile() {
+    const char* name = "unreadable file";
+    DiskQueueRamStorage ram;
+    DiskQueue queue(64 * 1024);
+    queue.setStorage(&ram);
+    if (!expect(SYSTEM_ERROR_NONE == queue.start("/drain"), name, "start failed")) {
+        return false;
+    }
+    queue.pushBack("aaa");
+    queue.pushBack("bbbb");
+    queue.pushBack("ccccc");
+
+    // Clear the magic byte of the second file
+    auto fd = ram.open("/drain/1", O_RDWR);
+    uint8_t zero = 0;
+    bool cleared = (0 <= fd) && (1 == ram.write(fd, &zero, sizeof(zero)));
+    ram.close(fd);
+    if (!expect(cleared, name, "file not corrupted")) {
+        return false;
+    }
+
+    std::string stream;
+    bool passed = expect(2 == queue.drainItems(collect, &stream), name, "expected 2 items drained");
+    passed = expect((std::string::npos != stream.find("aaa")) && (std::string::npos != stream.find("ccccc")) &&
+        (std::string::npos == stream.find("bbbb")), name, "unexpected items exported") && passed;
+    passed = expect(queue.isEmpty() && (0 == queue.drainItems(collect, &stream)), name, "items left after the drain") && passed;
+    return passed;
+}
+
+// Draining part of a segment leaves the following items of the segment at the front
+static bool partialSegment() {
+    const char* name = "partial segment";
+    DiskQueueRamStorage ram;
+    DiskQueue queue(64 * 1024);
+    queue.setStorage(&ram);
+    queue.setSegmentSize(1024);
+    if (!expect(SYSTEM_ERROR_NONE == queue.start("/drain"), name, "start failed")) {
+        return false;
+    }
+    queue.pushBack("aaa");
+    queue.pushBack("bbbb");
+    queue.pushBack("ccccc");
+
+    std::string stream;
+    bool passed = expect(2 == queue.drainItems(collect, &stream, 2), name, "expected 2 items drained");
+
+    char item[8] = {};
+    size_t size = sizeof(item) - 1;
+    passed = expect((1 == queue.size()) && queue.peekFront((uint8_t*)item, size) && !strcmp(item, "ccccc"),
+        name, "expected ccccc at the front") && passed;
+    return passed;
+}
+
+int main() {
+    bool passed = unreadableFile();
+    passed = partialSegment() && passed;
+    return passed ? 0 : 1;
+}
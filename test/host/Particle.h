@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// Minimal stand-in for the Device OS headers so that the library, its tests and the examples
+// build and run on a Linux host.  Only what they use is provided.
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef uint32_t system_tick_t;
+
+enum {
+    SYSTEM_ERROR_NONE = 0,
+    SYSTEM_ERROR_UNKNOWN = -100,
+    SYSTEM_ERROR_NOT_SUPPORTED = -120,
+    SYSTEM_ERROR_ALREADY_EXISTS = -150,
+    SYSTEM_ERROR_INVALID_ARGUMENT = -160,
+    SYSTEM_ERROR_TIMEOUT = -180,
+    SYSTEM_ERROR_NOT_FOUND = -200,
+    SYSTEM_ERROR_INVALID_STATE = -210,
+    SYSTEM_ERROR_BAD_DATA = -240,
+    SYSTEM_ERROR_NO_MEMORY = -260,
+    SYSTEM_ERROR_TOO_LARGE = -270,
+    SYSTEM_ERROR_LIMIT_EXCEEDED = -280,
+    SYSTEM_ERROR_NOT_ENOUGH_DATA = -290,
+    SYSTEM_ERROR_IO = -310,
+    SYSTEM_ERROR_FILE = -1000,
+};
+
+#define CHECK_TRUE(_expr, _ret) \
+    do { \
+        if (!(_expr)) { \
+            return _ret; \
+        } \
+    } while (false)
+
+#define CHECK_FALSE(_expr, _ret) CHECK_TRUE(!(_expr), _ret)
+
+#define CHECK(_expr) \
+    do { \
+        auto _ret = (_expr); \
+        if (_ret < 0) { \
+            return _ret; \
+        } \
+    } while (false)
+
+class String {
+public:
+    String() {}
+    String(const char* str) : _str(str ? str : "") {}
+    String(int value) : _str(std::to_string(value)) {}
+    String(unsigned int value) : _str(std::to_string(value)) {}
+    String(long value) : _str(std::to_string(value)) {}
+    String(unsigned long value) : _str(std::to_string(value)) {}
+
+    const char* c_str() const { return _str.c_str(); }
+    unsigned length() const { return _str.size(); }
+    operator const char*() const { return c_str(); }
+
+    String substring(unsigned from, unsigned to) const {
+        return String(_str.substr(from, to - from).c_str());
+    }
+
+    bool operator==(const String& other) const { return _str == other._str; }
+    bool operator==(const char* other) const { return _str == other; }
+
+    friend String operator+(const String& left, const String& right) {
+        return String((left._str + right._str).c_str());
+    }
+
+    static String format(const char* fmt, ...) {
+        char buf[256];
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        return String(buf);
+    }
+
+private:
+    std::string _str;
+};
+
+template<typename T>
+class Vector {
+public:
+    typedef typename std::vector<T>::iterator iterator;
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    Vector() {}
+    explicit Vector(int n) : _vec(n) {}
+    Vector(int n, const T& value) : _vec(n, value) {}
+
+    bool append(T value) { _vec.push_back(value); return true; }
+    bool insert(int i, T value) { _vec.insert(_vec.begin() + i, value); return true; }
+    void removeAt(int i, int n = 1) { _vec.erase(_vec.begin() + i, _vec.begin() + i + n); }
+    T takeFirst() { T value = _vec.front(); _vec.erase(_vec.begin()); return value; }
+    bool contains(const T& value) const { return std::find(_vec.begin(), _vec.end(), value) != _vec.end(); }
+
+    T& first() { return _vec.front(); }
+    const T& first() const { return _vec.front(); }
+    T& last() { return _vec.back(); }
+    const T& last() const { return _vec.back(); }
+    T& at(int i) { return _vec.at(i); }
+    const T& at(int i) const { return _vec.at(i); }
+    T& operator[](int i) { return _vec[i]; }
+    const T& operator[](int i) const { return _vec[i]; }
+    T* data() { return _vec.data(); }
+
+    int size() const { return (int)_vec.size(); }
+    int capacity() const { return (int)_vec.capacity(); }
+    bool isEmpty() const { return _vec.empty(); }
+    bool reserve(int n) { _vec.reserve(n); return true; }
+    bool resize(int n) { _vec.resize(n); return true; }
+    bool trimToSize() { _vec.shrink_to_fit(); return true; }
+    void clear() { _vec.clear(); }
+
+    iterator begin() { return _vec.begin(); }
+    iterator end() { return _vec.end(); }
+    const_iterator begin() const { return _vec.begin(); }
+    const_iterator end() const { return _vec.end(); }
+
+private:
+    std::vector<T> _vec;
+};
+
+class RecursiveMutex : public std::recursive_mutex {
+};
+
+inline system_tick_t millis() {
+    return (system_tick_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t micros() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void delay(unsigned ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void delayMicroseconds(unsigned us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+// Application macros and logging used by the examples, which run setup() once from main()
+#define SYSTEM_THREAD(_mode)
+#define SYSTEM_MODE(_mode)
+
+enum LogLevel {
+    LOG_LEVEL_TRACE,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+};
+
+class SerialLogHandler {
+public:
+    SerialLogHandler(int baud, LogLevel level) {}
+};
+
+class Logger {
+public:
+    void trace(const char* fmt, ...) { va_list args; va_start(args, fmt); log("TRACE", fmt, args); va_end(args); }
+    void info(const char* fmt, ...) { va_list args; va_start(args, fmt); log("INFO", fmt, args); va_end(args); }
+    void warn(const char* fmt, ...) { va_list args; va_start(args, fmt); log("WARN", fmt, args); va_end(args); }
+    void error(const char* fmt, ...) { va_list args; va_start(args, fmt); log("ERROR", fmt, args); va_end(args); }
+
+private:
+    void log(const char* level, const char* fmt, va_list args) {
+        printf("%s ", level);
+        vprintf(fmt, args);
+        printf("\n");
+        fflush(stdout);
+    }
+};
+
+static Logger Log __attribute__((unused));
+
+void setup();
+void loop();
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that the disk limit and file capacity drop the oldest items or refuse new ones, and never
+// lose the rest
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+static const unsigned PUSHES = 60;
+
+struct Case {
+    const char* name;
+    size_t segmentSize;
+    size_t diskLimit;
+    DiskQueuePolicy policy;
+};
+
+static const Case CASES[] = {
+    { "file per item, delete old", 0, 240, DiskQueuePolicy::FifoDeleteOld },
+    { "file per item, delete new", 0, 240, DiskQueuePolicy::FifoDeleteNew },
+    { "small segments, delete old", 128, 240, DiskQueuePolicy::FifoDeleteOld },
+    { "small segments, delete new", 128, 240, DiskQueuePolicy::FifoDeleteNew },
+    { "segments beyond the limit, delete old", 1024, 200, DiskQueuePolicy::FifoDeleteOld },
+    { "segments beyond the limit, delete new", 1024, 200, DiskQueuePolicy::FifoDeleteNew },
+};
+
+static bool expect(bool condition, const char* name, const char* what, unsigned i) {
+    if (!condition) {
+        Log.error("%s: %s at item %u", name, what, i);
+    }
+    return condition;
+}
+
+static bool run(const Case& test) {
+    DiskQueueRamStorage ram;
+    DiskQueue queue;
+    queue.setStorage(&ram);
+    queue.setSegmentSize(test.segmentSize);
+    if (!expect(SYSTEM_ERROR_NONE == queue.start("/limit", test.diskLimit, test.policy), test.name, "start failed", 0)) {
+        return false;
+    }
+
+    // Items pushed and not dropped yet, oldest first
+    Vector<unsigned> model;
+    bool passed = true;
+    for (unsigned i = 0; (i < PUSHES) && passed; i++) {
+        char item[16];
+        snprintf(item, sizeof(item), "item%05u", i);
+        size_t size = queue.size();
+        bool pushed = queue.pushBack(item);
+
+        if (DiskQueuePolicy::FifoDeleteNew == test.policy) {
+            // Items are refused once full, and those already queued stay
+            passed = expect(pushed || (1 < i), test.name, "refused while empty", i) && passed;
+            passed = expect(queue.size() == (size + (pushed ? 1 : 0)), test.name, "queued items dropped", i) && passed;
+        } else {
+            // The new item is kept along with at least some of the older ones
+            passed = expect(pushed, test.name, "refused", i) && passed;
+            passed = expect((queue.size() > 1) || (0 == i), test.name, "older items all dropped", i) && passed;
+        }
+        if (pushed) {
+            model.append(i);
+        }
+        passed = expect(queue.getCurrentDiskUsage() <= test.diskLimit, test.name, "over the limit", i) && passed;
+        passed = expect(queue.getCurrentDiskUsage() == ram.getUsage(), test.name, "disk usage out of step", i) && passed;
+    }
+
+    // What remains is the newest of the items pushed, in order
+    int first = model.size() - (int)queue.size();
+    passed = expect(0 <= first, test.name, "more items than pushed", 0) && passed;
+    for (int k = std::max(first, 0); passed && (k < model.size()); k++) {
+        char item[16];
+        char expected[16];
+        size_t size = sizeof(item) - 1;
+        snprintf(expected, sizeof(expected), "item%05u", model[k]);
+        memset(item, 0, sizeof(item));
+        passed = expect(queue.peekFront((uint8_t*)item, size) && !strcmp(item, expected), test.name, "wrong item read", model[k]);
+        queue.popFront();
+    }
+    return passed;
+}
+
+// A full file list drops its oldest file only once the new item has been written
+static bool capacityWriteFailure() {
+    const char* name = "capacity with a failed write";
+    DiskQueueRamStorage ram;
+    DiskQueueFaultStorage fault(ram);
+    bool passed = true;
+    {
+        DiskQueue queue;
+        queue.setStorage(&fault);
+        queue.setCapacity(3);
+        queue.start("/limit", 64 * 1024);
+        queue.pushBack("item0");
+        queue.pushBack("item1");
+        queue.pushBack("item2");
+
+        // The storage fails from the first write of the next push on
+        fault.setFault(fault.getSteps() + 2, DiskQueueFault::Crash);
+        passed = expect(!queue.pushBack("item3"), name, "push succeeded", 3) && passed;
+        passed = expect(3 == queue.size(), name, "items dropped", 3) && passed;
+    }
+
+    DiskQueue queue;
+    queue.setStorage(&ram);
+    queue.start("/limit", 64 * 1024);
+    for (unsigned i = 0; passed && (i < 3); i++) {
+        char item[16] = {};
+        char expected[16];
+        size_t size = sizeof(item) - 1;
+        snprintf(expected, sizeof(expected), "item%u", i);
+        passed = expect(queue.peekFront((uint8_t*)item, size) && !strcmp(item, expected), name, "wrong item read", i);
+        queue.popFront();
+    }
+    return passed;
+}
+
+int main() {
+    bool passed = true;
+    for (auto& test : CASES) {
+        passed = run(test) && passed;
+    }
+    passed = capacityWriteFailure() && passed;
+    return passed ? 0 : 1;
+}
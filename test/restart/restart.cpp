@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that a queue restarted without segments reads back segment files, and otherwise starts
+// without opening its files
+
+#include "Particle.h"
+#include "DiskQueue.h"
+
+static const size_t START_STEPS_MAX = 4;
+
+static bool expect(bool condition, const char* what) {
+    if (!condition) {
+        Log.error("%s", what);
+    }
+    return condition;
+}
+
+// Start a queue with one item per file and return the number of storage calls it took
+static size_t startPlain(DiskQueue& queue, DiskQueueFaultStorage& fault) {
+    size_t steps = fault.getSteps();
+    queue.setStorage(&fault);
+    queue.start("/restart", 64 * 1024);
+    return fault.getSteps() - steps;
+}
+
+static bool readBack(DiskQueue& queue, const char* prefix, unsigned count) {
+    for (unsigned i = 0; i < count; i++) {
+        char item[16] = {};
+        char expected[16];
+        size_t size = sizeof(item) - 1;
+        snprintf(expected, sizeof(expected), "%s%u", prefix, i);
+        if (!queue.peekFront((uint8_t*)item, size) || strcmp(item, expected)) {
+            return false;
+        }
+        queue.popFront();
+    }
+    return queue.isEmpty();
+}
+
+int main() {
+    DiskQueueRamStorage ram;
+    DiskQueueFaultStorage fault(ram);
+    bool passed = true;
+
+    {
+        DiskQueue queue;
+        queue.setStorage(&ram);
+        queue.setSegmentSize(64);
+        queue.start("/restart", 64 * 1024);
+        for (unsigned i = 0; i < 10; i++) {
+            char item[16];
+            snprintf(item, sizeof(item), "segment%u", i);
+            queue.pushBack(item);
+        }
+    }
+
+    // Segment files are found by opening every file
+    {
+        DiskQueue queue;
+        passed = expect(START_STEPS_MAX < startPlain(queue, fault), "segment files not opened") && passed;
+        passed = expect(10 == queue.size(), "segment items not counted") && passed;
+        passed = expect(readBack(queue, "segment", 10), "segment items not read back") && passed;
+        for (unsigned i = 0; i < 100; i++) {
+            char item[16];
+            snprintf(item, sizeof(item), "plain%u", i);
+            queue.pushBack(item);
+        }
+    }
+
+    // Without segment files left the directory is no longer marked and the files are not opened
+    for (int restart = 0; restart < 2; restart++) {
+        DiskQueue queue;
+        size_t steps = startPlain(queue, fault);
+        passed = expect((0 < restart) || (START_STEPS_MAX < steps), "files not opened before the mark is removed") && passed;
+        passed = expect((0 == restart) || (START_STEPS_MAX >= steps), "files opened after the mark is removed") && passed;
+        passed = expect(100 == queue.size(), "plain items not counted") && passed;
+    }
+    {
+        DiskQueue queue;
+        startPlain(queue, fault);
+        passed = expect(readBack(queue, "plain", 100), "plain items not read back") && passed;
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that a build with DISKQUEUE_TRACE records queue operations and dumps them as valid JSON
+
+#include "Particle.h"
+#include "DiskQueue.h"
+#include "DiskQueueTrace.h"
+
+#ifndef DISKQUEUE_TRACE
+#error "Build with DISKQUEUE_TRACE defined"
+#endif
+
+static bool expect(bool condition, const char* name, const char* what) {
+    if (!condition) {
+        Log.error("%s: %s", name, what);
+    }
+    return condition;
+}
+
+// Just enough of a JSON parser to validate the dump and count the objects in its arrays
+class JsonChecker {
+public:
+    JsonChecker(const std::string& text)
+    : _text(text),
+      _pos(0),
+      _objects(0) {
+
+    }
+
+    bool parse() {
+        return value() && (skipSpace(), _pos == _text.size());
+    }
+
+    size_t arrayObjects() const {
+        return _objects;
+    }
+
+private:
+    void skipSpace() {
+        while ((_pos < _text.size()) && strchr(" \t\r\n", _text[_pos])) {
+            _pos++;
+        }
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if ((_pos < _text.size()) && (_text[_pos] == c)) {
+            _pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool value() {
+        skipSpace();
+        if (_pos >= _text.size()) {
+            return false;
+        }
+        switch (_text[_pos]) {
+            case '{':
+                return object();
+            case '[':
+                return array();
+            case '"':
+                return string();
+            default:
+                return literal();
+        }
+    }
+
+    bool object() {
+        consume('{');
+        if (consume('}')) {
+            return true;
+        }
+        do {
+            skipSpace();
+            if (!string() || !consume(':') || !value()) {
+                return false;
+            }
+        } while (consume(','));
+        return consume('}');
+    }
+
+    bool array() {
+        consume('[');
+        if (consume(']')) {
+            return true;
+        }
+        do {
+            skipSpace();
+            if ((_pos < _text.size()) && ('{' == _text[_pos])) {
+                _objects++;
+            }
+            if (!value()) {
+                return false;
+            }
+        } while (consume(','));
+        return consume(']');
+    }
+
+    bool string() {
+        if ((_pos >= _text.size()) || ('"' != _text[_pos])) {
+            return false;
+        }
+        for (_pos++; _pos < _text.size(); _pos++) {
+            char c = _text[_pos];
+            if ('"' == c) {
+                _pos++;
+                return true;
+            }
+            if (('\\' == c) || ((unsigned char)c < 0x20)) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // Numbers and the true, false and null literals
+    bool literal() {
+        size_t start = _pos;
+        while ((_pos < _text.size()) && (isalnum((unsigned char)_text[_pos]) || strchr("+-.", _text[_pos]))) {
+            _pos++;
+        }
+        std::string token = _text.substr(start, _pos - start);
+        if (("true" == token) || ("false" == token) || ("null" == token)) {
+            return true;
+        }
+        char* end = nullptr;
+        strtod(token.c_str(), &end);
+        return !token.empty() && (end == token.c_str() + token.size()) && !isalpha((unsigned char)token[0]);
+    }
+
+    const std::string& _text;
+    size_t _pos;
+    size_t _objects;
+};
+
+// Dump the events held into a string
+static int dumpTrace(std::string& text) {
+    FILE* file = tmpfile();
+    if (!file) {
+        return SYSTEM_ERROR_IO;
+    }
+    int count = DiskQueueTrace::dump(fileno(file));
+    rewind(file);
+    char buffer[512];
+    size_t size = 0;
+    while (0 < (size = fread(buffer, 1, sizeof(buffer), file))) {
+        text.append(buffer, size);
+    }
+    fclose(file);
+    return count;
+}
+
+static bool checkDump(const char* name, size_t events, bool peeked) {
+    std::string text;
+    int count = dumpTrace(text);
+    bool passed = expect((int)events == count, name, "wrong number of events dumped");
+    JsonChecker json(text);
+    passed = expect(json.parse(), name, "dump is not valid JSON") && passed;
+    passed = expect(json.arrayObjects() == events, name, "wrong number of events in the dump") && passed;
+    passed = expect(std::string::npos != text.find("\"name\":\"pushBack\""), name, "pushBack not traced") && passed;
+    passed = expect(std::string::npos != text.find("\"name\":\"popFront\""), name, "popFront not traced") && passed;
+    passed = expect(!peeked || (std::string::npos != text.find("\"name\":\"peekFront\"")), name, "peekFront not traced") && passed;
+    return passed;
+}
+
+// Push, peek and pop a few items and dump what was recorded
+static bool operations() {
+    const char* name = "operations";
+    DiskQueueRamStorage ram;
+    DiskQueue queue(64 * 1024);
+    queue.setStorage(&ram);
+    queue.start("/trace");
+    DiskQueueTrace::clear();
+
+    uint8_t item[16];
+    for (unsigned i = 0; i < 8; i++) {
+        queue.pushBack("item");
+        size_t size = sizeof(item);
+        queue.peekFront(item, size);
+        if (i & 1) {
+            queue.popFront();
+        }
+    }
+    bool passed = expect(0 < DiskQueueTrace::count(), name, "no events recorded");
+    return checkDump(name, DiskQueueTrace::count(), true) && passed;
+}
+
+// Once the ring buffer has wrapped only the most recent events are dumped
+static bool wrapped() {
+    const char* name = "wrapped";
+    DiskQueueRamStorage ram;
+    DiskQueue queue(64 * 1024);
+    queue.setStorage(&ram);
+    queue.start("/trace");
+    DiskQueueTrace::clear();
+
+    for (unsigned i = 0; i < DISKQUEUE_TRACE_EVENTS; i++) {
+        queue.pushBack("item");
+        queue.popFront();
+    }
+    bool passed = expect(DISKQUEUE_TRACE_EVENTS == DiskQueueTrace::count(), name, "buffer not full");
+    return checkDump(name, DISKQUEUE_TRACE_EVENTS, false) && passed;
+}
+
+int main() {
+    bool passed = operations();
+    passed = wrapped() && passed;
+    return passed ? 0 : 1;
+}
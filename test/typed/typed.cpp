@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2021 Particle Industries, Inc.  All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that typed queues only return items that hold a valid value
+
+#include "Particle.h"
+#include "TypedDiskQueue.h"
+
+struct Sample {
+    uint32_t timestamp;
+    int16_t temperature;
+    uint16_t battery;
+};
+
+// A short label serialized as its characters without a terminator
+struct Label {
+    char text[8];
+};
+
+template <>
+struct DiskQueueSerializer<Label> {
+    static constexpr size_t FixedSize = 0;
+    static constexpr size_t MaxSize = sizeof(Label::text) - 1;
+
+    static size_t serialize(const Label& value, uint8_t* data, size_t size) {
+        size_t length = strnlen(value.text, sizeof(value.text));
+        if ((0 == length) || (length > size)) {
+            return 0;
+        }
+        memcpy(data, value.text, length);
+        return length;
+    }
+
+    static bool deserialize(const uint8_t* data, size_t size, Label& value) {
+        memset(value.text, 0, sizeof(value.text));
+        memcpy(value.text, data, size);
+        return true;
+    }
+};
+
+static bool expect(bool condition, const char* name, const char* what) {
+    if (!condition) {
+        Log.error("%s: %s", name, what);
+    }
+    return condition;
+}
+
+// Items of another size pushed through the base class are refused rather than truncated
+static bool raw() {
+    const char* name = "raw";
+    DiskQueueRamStorage ram;
+    TypedDiskQueue<Sample> queue;
+    queue.setStorage(&ram);
+    queue.start("/typed", 64 * 1024);
+
+    Sample sample = { 1000, 21, 4100 };
+    DiskQueue& base = queue;
+    uint8_t longer[sizeof(Sample) + 4] = {};
+    memcpy(longer, &sample, sizeof(sample));
+    queue.pushBack(sample);
+    base.pushBack(longer, sizeof(longer));
+    base.pushBack(longer, sizeof(Sample) - 1);
+    queue.pushBack(sample);
+
+    Sample front = {};
+    bool passed = expect(queue.peekFront(front) && !memcmp(&front, &sample, sizeof(sample)), name, "value not read");
+    queue.popFront();
+    passed = expect(!queue.peekFront(front), name, "longer item read as a value") && passed;
+    queue.popFront();
+    passed = expect(!queue.peekFront(front), name, "shorter item read as a value") && passed;
+    queue.popFront();
+    passed = expect(queue.peekFront(front) && !memcmp(&front, &sample, sizeof(sample)), name, "value not read") && passed;
+    return passed;
+}
+
+static bool serialized() {
+    const char* name = "serialized";
+    DiskQueueRamStorage ram;
+    TypedDiskQueue<Label> queue;
+    queue.setStorage(&ram);
+    queue.start("/typed", 64 * 1024);
+
+    Label label = { "abc" };
+    DiskQueue& base = queue;
+    queue.pushBack(label);
+    base.pushBack("abcdefghij");
+
+    Label front = {};
+    bool passed = expect(queue.peekFront(front) && !strcmp(front.text, "abc"), name, "value not read");
+    queue.popFront();
+    passed = expect(!queue.peekFront(front), name, "longer item read as a value") && passed;
+    return passed;
+}
+
+int main() {
+    bool passed = raw();
+    passed = serialized() && passed;
+    return passed ? 0 : 1;
+}